@@ -0,0 +1,102 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+// Ring buffer for exactly one producer thread and one consumer thread. TryPush and TryPop are
+// lock-free, Push and Pop sleep on a condition variable while the queue is full or empty.
+template <class T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) : buffer_(capacity + 1) {
+    }
+
+    bool TryPush(T& value) {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        size_t next = Next(tail);
+        if (next == head_.load(std::memory_order_acquire)) {
+            return false;
+        }
+        buffer_[tail] = std::move(value);
+        tail_.store(next, std::memory_order_release);
+        return true;
+    }
+
+    std::optional<T> TryPop() {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (head == tail_.load(std::memory_order_acquire)) {
+            return std::nullopt;
+        }
+        std::optional<T> res(std::move(buffer_[head]));
+        head_.store(Next(head), std::memory_order_release);
+        return res;
+    }
+
+    // Waits for room, returns false without pushing when the queue is closed.
+    bool Push(T& value) {
+        while (!TryPush(value)) {
+            std::unique_lock lock(mutex_);
+            not_full_.wait(lock, [this] { return closed_ || !Full(); });
+            if (closed_) {
+                return false;
+            }
+        }
+        Notify(not_empty_);
+        return true;
+    }
+
+    // Waits for a value, returns nullopt when the queue is closed and empty.
+    std::optional<T> Pop() {
+        while (true) {
+            if (auto res = TryPop()) {
+                Notify(not_full_);
+                return res;
+            }
+            std::unique_lock lock(mutex_);
+            not_empty_.wait(lock, [this] { return closed_ || !Empty(); });
+            if (closed_ && Empty()) {
+                return std::nullopt;
+            }
+        }
+    }
+
+    // Wakes both threads, a waiting Push fails and Pop fails once the queue is empty.
+    void Close() {
+        {
+            std::lock_guard lock(mutex_);
+            closed_ = true;
+        }
+        not_full_.notify_all();
+        not_empty_.notify_all();
+    }
+
+private:
+    bool Full() const {
+        return Next(tail_.load(std::memory_order_acquire)) == head_.load(std::memory_order_acquire);
+    }
+    bool Empty() const {
+        return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+    }
+    // Taking the lock orders the change before the check of a thread about to wait, so the
+    // wakeup is not lost.
+    void Notify(std::condition_variable& cv) {
+        {
+            std::lock_guard lock(mutex_);
+        }
+        cv.notify_one();
+    }
+    size_t Next(size_t index) const {
+        return index + 1 == buffer_.size() ? 0 : index + 1;
+    }
+
+    std::vector<T> buffer_;
+    alignas(64) std::atomic<size_t> head_ = 0;
+    alignas(64) std::atomic<size_t> tail_ = 0;
+    std::mutex mutex_;
+    std::condition_variable not_full_;
+    std::condition_variable not_empty_;
+    bool closed_ = false;
+};
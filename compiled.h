@@ -0,0 +1,111 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Interface between the interpreter and modules made by CompileDefinitions. Compiled code
+// includes only this header and reaches the interpreter through CompiledRuntime, so a module
+// does not link against the interpreter and loads into any program which embeds it.
+
+class Object;
+class GarbageCollector;
+
+struct CompiledRuntime {
+    GarbageCollector* collector;
+    Object* true_value;
+    Object* false_value;
+    void (*safepoint)(GarbageCollector*);
+    // Return false when the object is of another type.
+    bool (*get_number)(Object*, int64_t*);
+    bool (*get_boolean)(Object*, bool*);
+    bool (*get_pair)(Object*, Object**, Object**);
+    Object* (*make_number)(GarbageCollector*, int64_t);
+    Object* (*make_pair)(GarbageCollector*, Object*, Object*);
+};
+
+// Thrown by compiled code on a value it does not handle. Compiled functions have no effects
+// besides allocation, so the call is simply evaluated again by the interpreter, which reports
+// the error as usual.
+struct CompiledFallback {};
+
+using CompiledEntry = Object* (*)(const CompiledRuntime&, Object* const* args);
+
+struct CompiledDefinition {
+    const char* name;
+    size_t arity;
+    CompiledEntry entry;
+};
+
+// Every module exports its definitions through this function.
+extern "C" const CompiledDefinition* SchemeCompiledDefinitions(size_t* count);
+inline constexpr const char kCompiledDefinitionsSymbol[] = "SchemeCompiledDefinitions";
+
+namespace compiled {
+
+inline int64_t Int(const CompiledRuntime& rt, Object* obj) {
+    int64_t value;
+    if (!rt.get_number(obj, &value)) {
+        throw CompiledFallback();
+    }
+    return value;
+}
+
+inline bool Truth(const CompiledRuntime& rt, Object* obj) {
+    bool value;
+    if (!rt.get_boolean(obj, &value)) {
+        throw CompiledFallback();
+    }
+    return value;
+}
+
+inline Object* Box(const CompiledRuntime& rt, int64_t value) {
+    return rt.make_number(rt.collector, value);
+}
+
+inline Object* Bool(const CompiledRuntime& rt, bool value) {
+    return value ? rt.true_value : rt.false_value;
+}
+
+inline Object* Car(const CompiledRuntime& rt, Object* obj) {
+    Object* first;
+    Object* second;
+    if (!rt.get_pair(obj, &first, &second)) {
+        throw CompiledFallback();
+    }
+    return first;
+}
+
+inline Object* Cdr(const CompiledRuntime& rt, Object* obj) {
+    Object* first;
+    Object* second;
+    if (!rt.get_pair(obj, &first, &second)) {
+        throw CompiledFallback();
+    }
+    return second;
+}
+
+inline Object* Cons(const CompiledRuntime& rt, Object* first, Object* second) {
+    return rt.make_pair(rt.collector, first, second);
+}
+
+// Arithmetic wraps around like the interpreter's, without undefined behaviour.
+inline int64_t Add(int64_t a, int64_t b) {
+    return static_cast<int64_t>(static_cast<uint64_t>(a) + static_cast<uint64_t>(b));
+}
+
+inline int64_t Sub(int64_t a, int64_t b) {
+    return static_cast<int64_t>(static_cast<uint64_t>(a) - static_cast<uint64_t>(b));
+}
+
+inline int64_t Mul(int64_t a, int64_t b) {
+    return static_cast<int64_t>(static_cast<uint64_t>(a) * static_cast<uint64_t>(b));
+}
+
+inline int64_t Div(int64_t a, int64_t b) {
+    if (!b || (b == -1 && a == INT64_MIN)) {
+        throw CompiledFallback();
+    }
+    return a / b;
+}
+
+}  // namespace compiled
@@ -0,0 +1,439 @@
+#include "compiler.h"
+
+#include <dlfcn.h>
+
+#include <optional>
+#include <unordered_map>
+#include <utility>
+
+#include "function.h"
+#include "parser.h"
+
+namespace {
+
+enum class Type { INT, BOOL, OBJ };
+
+struct Code {
+    std::string text;
+    Type type;
+};
+
+struct Definition {
+    std::string name;
+    std::vector<std::string> params;
+    Object* body;
+};
+
+// Elements of a proper list, nullopt for other objects.
+std::optional<std::vector<Object*>> Items(Object* obj) {
+    std::vector<Object*> res;
+    while (obj) {
+        auto cell = dynamic_cast<Cell*>(obj);
+        if (!cell) {
+            return std::nullopt;
+        }
+        res.push_back(cell->GetFirst());
+        obj = cell->GetSecond();
+    }
+    return res;
+}
+
+bool IsSymbol(Object* obj, const char* name) {
+    auto sp = dynamic_cast<Symbol*>(obj);
+    return sp && sp->GetName() == name;
+}
+
+std::optional<Definition> ParseDefinition(Object* form) {
+    auto items = Items(form);
+    if (!items || items->size() != 3 || !IsSymbol((*items)[0], "define")) {
+        return std::nullopt;
+    }
+    Definition res;
+    std::optional<std::vector<Object*>> params;
+    if (auto sp = dynamic_cast<Symbol*>((*items)[1])) {
+        auto lambda = Items((*items)[2]);
+        if (!lambda || lambda->size() != 3 || !IsSymbol((*lambda)[0], "lambda")) {
+            return std::nullopt;
+        }
+        res.name = sp->GetName();
+        params = Items((*lambda)[1]);
+        res.body = (*lambda)[2];
+    } else {
+        params = Items((*items)[1]);
+        if (!params || params->empty() || !dynamic_cast<Symbol*>(params->front())) {
+            return std::nullopt;
+        }
+        res.name = static_cast<Symbol*>(params->front())->GetName();
+        params->erase(params->begin());
+        res.body = (*items)[2];
+    }
+    if (!params) {
+        return std::nullopt;
+    }
+    for (auto param : *params) {
+        auto sp = dynamic_cast<Symbol*>(param);
+        if (!sp) {
+            return std::nullopt;
+        }
+        for (const auto& other : res.params) {
+            if (other == sp->GetName()) {
+                return std::nullopt;
+            }
+        }
+        res.params.push_back(sp->GetName());
+    }
+    return res;
+}
+
+// Expressions are compiled to C++ expressions of one of three types. Numbers and booleans
+// stay unboxed between operations and are boxed only where an object is needed.
+class Generator {
+public:
+    explicit Generator(const std::vector<Definition>& functions) : functions_(functions) {
+    }
+
+    std::optional<std::string> CompileAs(Object* expr, const Definition& def, Type type) {
+        auto code = Compile(expr, def);
+        if (!code) {
+            return std::nullopt;
+        }
+        return Convert(*code, type);
+    }
+
+    // Indices of the functions which the expressions compiled since the last call call.
+    std::vector<size_t> TakeCalls() {
+        return std::exchange(calls_, {});
+    }
+
+private:
+    static std::optional<std::string> Convert(const Code& code, Type type) {
+        if (code.type == type) {
+            return code.text;
+        }
+        if (type == Type::OBJ) {
+            return (code.type == Type::INT ? "Box(rt, " : "Bool(rt, ") + code.text + ")";
+        }
+        if (code.type == Type::OBJ) {
+            return (type == Type::INT ? "Int(rt, " : "Truth(rt, ") + code.text + ")";
+        }
+        return std::nullopt;
+    }
+
+    std::optional<std::vector<std::string>> CompileAll(std::span<Object* const> exprs,
+                                                       const Definition& def, Type type) {
+        std::vector<std::string> res;
+        for (auto expr : exprs) {
+            auto code = CompileAs(expr, def, type);
+            if (!code) {
+                return std::nullopt;
+            }
+            res.push_back(std::move(*code));
+        }
+        return res;
+    }
+
+    std::optional<Code> Compile(Object* expr, const Definition& def) {
+        if (auto np = dynamic_cast<Number*>(expr)) {
+            return Code{"int64_t{" + std::to_string(np->GetValue()) + "}", Type::INT};
+        } else if (auto bp = dynamic_cast<Boolean*>(expr)) {
+            return Code{bp->GetValue() ? "true" : "false", Type::BOOL};
+        } else if (auto sp = dynamic_cast<Symbol*>(expr)) {
+            for (size_t i = 0; i != def.params.size(); ++i) {
+                if (def.params[i] == sp->GetName()) {
+                    return Code{"arg" + std::to_string(i), Type::OBJ};
+                }
+            }
+            return std::nullopt;
+        }
+        auto items = Items(expr);
+        if (!expr || !items || !dynamic_cast<Symbol*>(items->front())) {
+            return std::nullopt;
+        }
+        auto name = static_cast<Symbol*>(items->front())->GetName();
+        auto args = std::span<Object* const>(*items).subspan(1);
+        if (name == "quote") {
+            if (args.size() == 1 && !args[0]) {
+                return Code{"static_cast<Object*>(nullptr)", Type::OBJ};
+            } else if (args.size() == 1 && dynamic_cast<Number*>(args[0])) {
+                return Compile(args[0], def);
+            }
+            return std::nullopt;
+        } else if (name == "+" || name == "*" || name == "-" || name == "/") {
+            return Arithmetic(name, args, def);
+        } else if (name == "<" || name == ">" || name == "<=" || name == ">=" || name == "=") {
+            return Comparison(name == "=" ? "==" : name, args, def);
+        } else if (name == "if") {
+            return If(args, def);
+        } else if (name == "car" || name == "cdr") {
+            // The interpreter rejects a constant operand before looking at it.
+            if (args.size() != 1 || !args[0] || dynamic_cast<Number*>(args[0]) ||
+                dynamic_cast<Boolean*>(args[0])) {
+                return std::nullopt;
+            }
+            auto arg = CompileAs(args[0], def, Type::OBJ);
+            if (!arg) {
+                return std::nullopt;
+            }
+            return Code{(name == "car" ? "Car(rt, " : "Cdr(rt, ") + *arg + ")", Type::OBJ};
+        } else if (name == "cons") {
+            auto parts = args.size() == 2 ? CompileAll(args, def, Type::OBJ) : std::nullopt;
+            if (!parts) {
+                return std::nullopt;
+            }
+            return Code{"Cons(rt, " + (*parts)[0] + ", " + (*parts)[1] + ")", Type::OBJ};
+        }
+        return Call(name, args, def);
+    }
+
+    std::optional<Code> Arithmetic(const std::string& name, std::span<Object* const> args,
+                                   const Definition& def) {
+        if (args.empty()) {
+            if (name == "+" || name == "*") {
+                return Code{name == "+" ? "int64_t{0}" : "int64_t{1}", Type::INT};
+            }
+            return std::nullopt;
+        }
+        auto operands = CompileAll(args, def, Type::INT);
+        if (!operands) {
+            return std::nullopt;
+        }
+        const char* op = name == "+" ? "Add" : name == "*" ? "Mul" : name == "-" ? "Sub" : "Div";
+        auto res = (*operands)[0];
+        for (size_t i = 1; i != operands->size(); ++i) {
+            res = std::string(op) + "(" + res + ", " + (*operands)[i] + ")";
+        }
+        return Code{res, Type::INT};
+    }
+
+    // Every operand is evaluated, as in the interpreter.
+    std::optional<Code> Comparison(const std::string& op, std::span<Object* const> args,
+                                   const Definition& def) {
+        auto operands = CompileAll(args, def, Type::INT);
+        if (!operands) {
+            return std::nullopt;
+        }
+        if (operands->empty()) {
+            return Code{"true", Type::BOOL};
+        } else if (operands->size() == 1) {
+            return Code{"(static_cast<void>(" + (*operands)[0] + "), true)", Type::BOOL};
+        } else if (operands->size() == 2) {
+            return Code{"(" + (*operands)[0] + " " + op + " " + (*operands)[1] + ")", Type::BOOL};
+        }
+        std::string res = "[&] {";
+        for (size_t i = 0; i != operands->size(); ++i) {
+            res += " const int64_t v" + std::to_string(i) + " = " + (*operands)[i] + ";";
+        }
+        res += " return";
+        for (size_t i = 1; i != operands->size(); ++i) {
+            res += (i > 1 ? " &&" : "") + std::string(" v") + std::to_string(i - 1) + " " + op +
+                   " v" + std::to_string(i);
+        }
+        return Code{res + "; }()", Type::BOOL};
+    }
+
+    std::optional<Code> If(std::span<Object* const> args, const Definition& def) {
+        if (args.size() != 2 && args.size() != 3) {
+            return std::nullopt;
+        }
+        auto cond = CompileAs(args[0], def, Type::BOOL);
+        auto then = Compile(args[1], def);
+        auto other = args.size() == 3 ? Compile(args[2], def)
+                                      : Code{"static_cast<Object*>(nullptr)", Type::OBJ};
+        if (!cond || !then || !other) {
+            return std::nullopt;
+        }
+        auto type = then->type == other->type ? then->type : Type::OBJ;
+        auto first = Convert(*then, type);
+        auto second = Convert(*other, type);
+        return Code{"(" + *cond + " ? " + *first + " : " + *second + ")", type};
+    }
+
+    std::optional<Code> Call(const std::string& name, std::span<Object* const> args,
+                             const Definition& def) {
+        for (const auto& param : def.params) {
+            if (param == name) {
+                return std::nullopt;
+            }
+        }
+        for (size_t i = 0; i != functions_.size(); ++i) {
+            if (functions_[i].name != name || functions_[i].params.size() != args.size()) {
+                continue;
+            }
+            auto operands = CompileAll(args, def, Type::OBJ);
+            if (!operands) {
+                return std::nullopt;
+            }
+            std::string res = "fn" + std::to_string(i) + "(rt";
+            for (const auto& operand : *operands) {
+                res += ", " + operand;
+            }
+            calls_.push_back(i);
+            return Code{res + ")", Type::OBJ};
+        }
+        return std::nullopt;
+    }
+
+    const std::vector<Definition>& functions_;
+    std::vector<size_t> calls_;
+};
+
+std::string Signature(size_t index, const Definition& def) {
+    std::string res = "Object* fn" + std::to_string(index) + "(const CompiledRuntime& rt";
+    for (size_t i = 0; i != def.params.size(); ++i) {
+        res += ", Object* arg" + std::to_string(i);
+    }
+    return res + ")";
+}
+
+void CompiledSafepoint(GarbageCollector* collector) {
+    collector->Safepoint();
+}
+
+bool GetNumberValue(Object* obj, int64_t* value) {
+    auto np = dynamic_cast<Number*>(obj);
+    if (np) {
+        *value = np->GetValue();
+    }
+    return np;
+}
+
+bool GetBooleanValue(Object* obj, bool* value) {
+    auto bp = dynamic_cast<Boolean*>(obj);
+    if (bp) {
+        *value = bp->GetValue();
+    }
+    return bp;
+}
+
+bool GetPairParts(Object* obj, Object** first, Object** second) {
+    auto cell = dynamic_cast<Cell*>(obj);
+    if (cell) {
+        *first = cell->GetFirst();
+        *second = cell->GetSecond();
+    }
+    return cell;
+}
+
+Object* MakeNumber(GarbageCollector* collector, int64_t value) {
+    return collector->AddObj(new Number(value));
+}
+
+Object* MakePair(GarbageCollector* collector, Object* first, Object* second) {
+    return collector->AddObj(new Cell(first, second, collector));
+}
+
+}  // namespace
+
+std::string CompileDefinitions(std::string_view source, std::vector<std::string>* compiled) {
+    GarbageCollector memory;
+    std::vector<Definition> functions;
+    for (auto form : ReadData(source, &memory)) {
+        if (auto def = ParseDefinition(form)) {
+            std::erase_if(functions, [&def](const Definition& other) {
+                return other.name == def->name;
+            });
+            functions.push_back(std::move(*def));
+        }
+    }
+
+    // A function is dropped when its body uses anything else, and so is every function which
+    // calls a dropped one. The rest only call each other, the next round compiles all of them
+    // with their new indices.
+    std::vector<std::string> bodies;
+    while (true) {
+        Generator generator(functions);
+        bodies.clear();
+        std::vector<std::vector<size_t>> callers(functions.size());
+        std::vector<size_t> dropped;
+        std::vector<bool> is_dropped(functions.size());
+        for (size_t i = 0; i != functions.size(); ++i) {
+            if (auto body = generator.CompileAs(functions[i].body, functions[i], Type::OBJ)) {
+                bodies.push_back(std::move(*body));
+            } else {
+                dropped.push_back(i);
+                is_dropped[i] = true;
+            }
+            for (auto callee : generator.TakeCalls()) {
+                callers[callee].push_back(i);
+            }
+        }
+        if (dropped.empty()) {
+            break;
+        }
+        while (!dropped.empty()) {
+            auto callee = dropped.back();
+            dropped.pop_back();
+            for (auto caller : callers[callee]) {
+                if (!is_dropped[caller]) {
+                    is_dropped[caller] = true;
+                    dropped.push_back(caller);
+                }
+            }
+        }
+        std::vector<Definition> rest;
+        for (size_t i = 0; i != functions.size(); ++i) {
+            if (!is_dropped[i]) {
+                rest.push_back(std::move(functions[i]));
+            }
+        }
+        functions = std::move(rest);
+    }
+
+    std::string res = "// Generated by CompileDefinitions.\n#include \"compiled.h\"\n\n";
+    res += "namespace {\n\nusing namespace compiled;\n\n";
+    for (size_t i = 0; i != functions.size(); ++i) {
+        res += Signature(i, functions[i]) + ";\n";
+    }
+    for (size_t i = 0; i != functions.size(); ++i) {
+        res += "\n// " + functions[i].name + "\n" + Signature(i, functions[i]) + " {\n";
+        res += "    rt.safepoint(rt.collector);\n    return " + bodies[i] + ";\n}\n";
+        res += "\nObject* entry" + std::to_string(i) + "(const CompiledRuntime& rt, Object* const*";
+        res += functions[i].params.empty() ? ") {\n" : " args) {\n";
+        res += "    return fn" + std::to_string(i) + "(rt";
+        for (size_t j = 0; j != functions[i].params.size(); ++j) {
+            res += ", args[" + std::to_string(j) + "]";
+        }
+        res += ");\n}\n";
+        if (compiled) {
+            compiled->push_back(functions[i].name);
+        }
+    }
+    res += "\nconst CompiledDefinition kDefinitions[] = {\n";
+    for (size_t i = 0; i != functions.size(); ++i) {
+        res += "    {\"" + functions[i].name + "\", " + std::to_string(functions[i].params.size()) +
+               ", entry" + std::to_string(i) + "},\n";
+    }
+    res += "    {nullptr, 0, nullptr},\n};\n\n}  // namespace\n\n";
+    res += "extern \"C\" const CompiledDefinition* SchemeCompiledDefinitions(size_t* count) {\n";
+    res += "    *count = " + std::to_string(functions.size()) + ";\n    return kDefinitions;\n}\n";
+    return res;
+}
+
+size_t BindCompiled(const std::string& path, Scope* root) {
+    auto module = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (!module) {
+        throw RuntimeError("Cannot open module " + path + ": " + dlerror());
+    }
+    auto definitions = reinterpret_cast<decltype(&SchemeCompiledDefinitions)>(
+        dlsym(module, kCompiledDefinitionsSymbol));
+    if (!definitions) {
+        throw RuntimeError("Not a compiled module " + path);
+    }
+    size_t count;
+    auto table = definitions(&count);
+    size_t res = 0;
+    for (size_t i = 0; i != count; ++i) {
+        auto slot = root->Find(table[i].name);
+        auto lambda = slot ? dynamic_cast<LambdaFunc*>(*slot) : nullptr;
+        if (lambda && lambda->SetCompiled(table[i].entry, table[i].arity)) {
+            ++res;
+        }
+    }
+    return res;
+}
+
+CompiledRuntime MakeCompiledRuntime(GarbageCollector* collector) {
+    return {collector,      GetBoolConstant(true), GetBoolConstant(false),
+            CompiledSafepoint, GetNumberValue,     GetBooleanValue,
+            GetPairParts,   MakeNumber,            MakePair};
+}
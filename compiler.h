@@ -0,0 +1,26 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "compiled.h"
+#include "memory_control.h"
+
+// C++ source of a module with those definitions of source which can be compiled: functions
+// defined by (define (f ...) body) or (define f (lambda (...) body)) whose single body
+// expression uses only their parameters, numbers, #t, #f, '(), if, + - * /, comparisons,
+// car, cdr, cons and calls of other compiled functions. Names of the compiled functions are
+// appended to compiled when it is given. The module includes only compiled.h, build it with
+//   g++ -std=c++20 -O2 -shared -fPIC -I<this directory> module.cpp -o module.so
+// Calls between compiled functions are direct, a later redefinition of one of them is not
+// seen by the others.
+std::string CompileDefinitions(std::string_view source,
+                               std::vector<std::string>* compiled = nullptr);
+
+// Opens a module and lets the functions defined in root with the same names and arities run
+// its code. Returns how many functions were bound. The module stays loaded until the program
+// exits, since bound functions keep pointers into it.
+size_t BindCompiled(const std::string& path, Scope* root);
+
+CompiledRuntime MakeCompiledRuntime(GarbageCollector* collector);
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <string>
+#include <utility>
+#include <variant>
+
+enum class ErrorKind { SYNTAX, NAME, RUNTIME };
+
+struct EvalError {
+    ErrorKind kind;
+    std::string message;
+};
+
+// Printed value of an expression or the error it failed with, in the manner of std::expected.
+class EvalResult {
+public:
+    EvalResult(std::string value) : data_(std::move(value)) {
+    }
+    EvalResult(EvalError error) : data_(std::move(error)) {
+    }
+
+    bool HasValue() const {
+        return data_.index() == 0;
+    }
+    explicit operator bool() const {
+        return HasValue();
+    }
+    // Value throws std::bad_variant_access for an error and Error does for a value.
+    const std::string& Value() const {
+        return std::get<std::string>(data_);
+    }
+    const EvalError& Error() const {
+        return std::get<EvalError>(data_);
+    }
+
+private:
+    std::variant<std::string, EvalError> data_;
+};
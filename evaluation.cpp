@@ -0,0 +1,66 @@
+#include "evaluation.h"
+
+namespace {
+
+// Reading the clock on every call would cost more than the call itself.
+const size_t kClockPeriod = 64;
+
+}  // namespace
+
+Evaluation::Evaluation(GarbageCollector* collector, std::function<std::string()> body)
+    : collector_(collector), fiber_([this, body = std::move(body)] { result_ = body(); }) {
+    collector_->Pin();
+}
+
+Evaluation::~Evaluation() {
+    if (!IsFinished()) {
+        Cancel();
+        Resume(EvalLimits());
+    }
+}
+
+bool Evaluation::Resume(const EvalLimits& limits) {
+    if (IsFinished()) {
+        return true;
+    }
+    fuel_ = limits.fuel;
+    has_deadline_ = limits.time_slice.count() > 0;
+    deadline_ = std::chrono::steady_clock::now() + limits.time_slice;
+    auto previous = collector_->SetBudget(this);
+    try {
+        fiber_.Resume();
+    } catch (...) {
+        error_ = std::current_exception();
+    }
+    collector_->SetBudget(previous);
+    if (IsFinished()) {
+        collector_->Unpin();
+    }
+    return IsFinished();
+}
+
+const std::string& Evaluation::Result() const {
+    if (!IsFinished()) {
+        throw RuntimeError("Evaluation is not finished");
+    }
+    if (error_) {
+        std::rethrow_exception(error_);
+    }
+    return result_;
+}
+
+void Evaluation::Tick() {
+    if (cancelled_) {
+        throw RuntimeError("Evaluation is cancelled");
+    }
+    bool spent = fuel_ && --fuel_ == 0;
+    if (has_deadline_ && ++ticks_ % kClockPeriod == 0) {
+        spent |= std::chrono::steady_clock::now() >= deadline_;
+    }
+    if (spent) {
+        fiber_.Suspend();
+        if (cancelled_) {
+            throw RuntimeError("Evaluation is cancelled");
+        }
+    }
+}
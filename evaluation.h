@@ -0,0 +1,51 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <string>
+
+#include "fiber.h"
+#include "memory_control.h"
+
+// Fuel is counted in function calls, zero values mean no limit.
+struct EvalLimits {
+    size_t fuel = 0;
+    std::chrono::nanoseconds time_slice{0};
+};
+
+// Evaluation which suspends when its limits are spent and continues from the same point on
+// the next Resume, possibly on another thread.
+class Evaluation : public EvalBudget {
+public:
+    Evaluation(GarbageCollector* collector, std::function<std::string()> body);
+    Evaluation(const Evaluation&) = delete;
+    Evaluation& operator=(const Evaluation&) = delete;
+    ~Evaluation();
+
+    // Returns true when the evaluation has finished.
+    bool Resume(const EvalLimits& limits);
+    bool IsFinished() const {
+        return fiber_.IsFinished();
+    }
+    // Result of a finished evaluation, rethrows its error.
+    const std::string& Result() const;
+    // May be called from any thread, the evaluation stops at its next safepoint.
+    void Cancel() {
+        cancelled_ = true;
+    }
+
+    void Tick() override;
+
+private:
+    GarbageCollector* collector_;
+    Fiber fiber_;
+    std::string result_;
+    std::exception_ptr error_;
+    std::atomic<bool> cancelled_ = false;
+    size_t fuel_ = 0;
+    bool has_deadline_ = false;
+    std::chrono::steady_clock::time_point deadline_;
+    size_t ticks_ = 0;
+};
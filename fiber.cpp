@@ -0,0 +1,73 @@
+#include "fiber.h"
+
+#include <atomic>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "error.h"
+
+namespace {
+
+thread_local Fiber* current_fiber = nullptr;
+std::atomic<uint64_t> switches = 0;
+
+}  // namespace
+
+Fiber::Fiber(std::function<void()> body, size_t stack_size)
+    : body_(std::move(body)), stack_size_(stack_size) {
+    void* stack = mmap(nullptr, stack_size_, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (stack == MAP_FAILED) {
+        throw RuntimeError("Cannot allocate fiber stack");
+    }
+    stack_ = static_cast<char*>(stack);
+    // The lowest page stays unmapped, so a stack overflow faults instead of corrupting memory.
+    mprotect(stack_, sysconf(_SC_PAGESIZE), PROT_NONE);
+    getcontext(&context_);
+    context_.uc_stack.ss_sp = stack_;
+    context_.uc_stack.ss_size = stack_size_;
+    context_.uc_link = &caller_;
+    makecontext(&context_, &Fiber::Start, 0);
+}
+
+Fiber::~Fiber() {
+    munmap(stack_, stack_size_);
+}
+
+Fiber* Fiber::Current() {
+    return current_fiber;
+}
+
+uint64_t Fiber::Switches() {
+    return switches.load(std::memory_order_relaxed);
+}
+
+void Fiber::Start() {
+    auto fiber = current_fiber;
+    try {
+        fiber->body_();
+    } catch (...) {
+        fiber->error_ = std::current_exception();
+    }
+    fiber->finished_ = true;
+}
+
+void Fiber::Resume() {
+    if (finished_) {
+        return;
+    }
+    previous_ = current_fiber;
+    current_fiber = this;
+    switches.fetch_add(1, std::memory_order_relaxed);
+    swapcontext(&caller_, &context_);
+    current_fiber = previous_;
+    if (error_) {
+        std::rethrow_exception(std::exchange(error_, nullptr));
+    }
+}
+
+void Fiber::Suspend() {
+    switches.fetch_add(1, std::memory_order_relaxed);
+    swapcontext(&context_, &caller_);
+}
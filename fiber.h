@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <utility>
+
+#include <ucontext.h>
+
+// Stackful coroutine: the body runs on its own stack and may give control back from any depth
+// of Eval recursion. A fiber must not be resumed by two threads at the same time.
+class Fiber {
+public:
+    explicit Fiber(std::function<void()> body, size_t stack_size = 8 << 20);
+    Fiber(const Fiber&) = delete;
+    Fiber& operator=(const Fiber&) = delete;
+    ~Fiber();
+
+    // Runs the body until it suspends or finishes, an exception escaped from the body is
+    // rethrown here.
+    void Resume();
+    // Called from the body, returns control to the caller of Resume.
+    void Suspend();
+    bool IsFinished() const {
+        return finished_;
+    }
+
+    static Fiber* Current();
+    // Counts every switch between fibers of all threads.
+    static uint64_t Switches();
+
+private:
+    static void Start();
+
+    std::function<void()> body_;
+    char* stack_;
+    size_t stack_size_;
+    ucontext_t context_;
+    ucontext_t caller_;
+    Fiber* previous_ = nullptr;
+    bool finished_ = false;
+    std::exception_ptr error_;
+};
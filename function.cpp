@@ -1,18 +1,55 @@
 #include "function.h"
 
-Object* EvalBoolValue(bool b) {
+#include <algorithm>
+#include <thread>
+
+#include "module_cache.h"
+#include "parser.h"
+
+Boolean* EvalBoolValue(bool b) {
     return (b) ? new Boolean{"#t"} : new Boolean{"#f"};
 }
 
+Object* GetBoolConstant(bool b) {
+    static Boolean true_value("#t");
+    static Boolean false_value("#f");
+    return b ? &true_value : &false_value;
+}
+
+bool LambdaFunc::SetCompiled(CompiledEntry entry, size_t arity) {
+    auto params = dynamic_cast<Holder*>(data_[0]);
+    if (data_.size() != 2 || (data_[0] && !params) || (params ? params->Size() : 0) != arity) {
+        return false;
+    }
+    compiled_ = entry;
+    compiled_arity_ = arity;
+    return true;
+}
+
+int64_t GetNumberArg(Object* arg, Scope* scope, const char* where) {
+    if (auto eval = CanEval(arg, scope)) {
+        arg = eval;
+    }
+    auto np = dynamic_cast<Number*>(arg);
+    if (!np) {
+        Fail(scope, ErrorKind::RUNTIME, std::string("Unexpected argument in ") + where);
+        return 0;
+    }
+    return np->GetValue();
+}
+
+Object* Fail(Scope* scope, ErrorKind kind, const std::string& message) {
+    return scope->Collector()->Fail(kind, message);
+}
+
 Object* CanEval(Object* obj, Scope* scope) {
-    if (dynamic_cast<Holder*>(obj) || dynamic_cast<Function*>(obj) || dynamic_cast<Symbol*>(obj) ||
-        dynamic_cast<Quote*>(obj)) {
+    if (obj && obj->IsExpression()) {
         return obj->Eval(scope);
     }
     return nullptr;
 }
 
-bool CheckAllNumbers(const std::vector<Object*>& args, Scope* scope,
+bool CheckAllNumbers(std::span<Object* const> args, Scope* scope,
                      std::vector<Object*>& eval_args) {
     for (size_t i = 0; i != args.size(); ++i) {
         if (auto eval_arg = CanEval(args[i], scope)) {
@@ -34,3 +71,492 @@ bool MakeLogicOperation(bool is_and, bool cur, bool next) {
         return cur || next;
     }
 }
+
+void FindNames(Object* obj, std::unordered_set<std::string>& names) {
+    if (!obj) {
+        return;
+    }
+    std::unordered_set<Object*> reached;
+    obj->MarkAll(reached);
+    std::unordered_set<Object*> quoted;
+    for (auto el : reached) {
+        if (auto qp = dynamic_cast<Quote*>(el)) {
+            if (auto data = qp->Eval(nullptr)) {
+                data->MarkAll(quoted);
+            }
+        }
+    }
+    for (auto el : reached) {
+        if (auto sp = dynamic_cast<Symbol*>(el); sp && !quoted.contains(el)) {
+            names.insert(sp->GetName());
+        }
+    }
+}
+
+void FindAssigned(Object* obj, std::unordered_set<std::string>& names) {
+    if (!obj) {
+        return;
+    }
+    std::unordered_set<Object*> reached;
+    obj->MarkAll(reached);
+    for (auto el : reached) {
+        if (auto sp = dynamic_cast<Set*>(el)) {
+            if (auto variable = sp->Variable()) {
+                names.insert(variable->GetName());
+            }
+        }
+    }
+}
+
+Object* CopyCells(Object* obj, GarbageCollector* collector) {
+    std::vector<Cell*> cells;
+    while (obj && typeid(*obj) == typeid(Cell)) {
+        cells.push_back(static_cast<Cell*>(obj));
+        obj = cells.back()->GetSecond();
+    }
+    for (auto it = cells.rbegin(); it != cells.rend(); ++it) {
+        auto first = CopyCells((*it)->GetFirst(), collector);
+        obj = collector->AddObj(new Cell(first, obj, collector));
+    }
+    return obj;
+}
+
+bool DefineMemoized::IsPure(Object* params, std::span<Object* const> body,
+                            const std::string& self, Scope* scope,
+                            std::unordered_set<Object*>& checked) {
+    std::unordered_set<Object*> reached;
+    for (auto el : body) {
+        if (el) {
+            el->MarkAll(reached);
+        }
+    }
+    std::unordered_set<Object*> quoted;
+    for (auto el : reached) {
+        if (auto qp = dynamic_cast<Quote*>(el)) {
+            if (auto data = qp->Eval(nullptr)) {
+                data->MarkAll(quoted);
+            }
+        }
+    }
+    // Variables bound inside the function shadow the global ones. Of those only the functions
+    // defined in the body are known, their bodies are among the reached nodes. Binding lists
+    // and clauses are parsed as calls, they are recognized by the symbol they begin with or
+    // by the form they belong to.
+    std::unordered_set<std::string> locals;
+    std::unordered_set<std::string> local_functions;
+    std::unordered_set<const Object*> binders;
+    std::unordered_set<const Object*> clauses;
+    auto bind = [&](Object* form) {
+        if (auto hp = dynamic_cast<Holder*>(form); hp && hp->Size()) {
+            binders.insert((*hp)[0]);
+        }
+        FindNames(form, locals);
+    };
+    bind(params);
+    for (auto el : reached) {
+        if (quoted.contains(el)) {
+            continue;
+        }
+        if (auto lp = dynamic_cast<LambdaFunc*>(el)) {
+            bind(lp->data_[0]);
+        } else if (auto dp = dynamic_cast<Define*>(el); dp && !dp->args_.empty()) {
+            bind(dp->args_[0]);
+            if (auto hp = dynamic_cast<Holder*>(dp->args_[0]); hp && hp->Size()) {
+                local_functions.insert(static_cast<Symbol*>((*hp)[0])->GetName());
+            } else if (auto sp = dynamic_cast<Symbol*>(dp->args_[0]);
+                       sp && dp->args_.size() == 2 && dynamic_cast<LambdaFunc*>(dp->args_[1])) {
+                local_functions.insert(sp->GetName());
+            }
+        } else if (auto lp = dynamic_cast<LetFunc*>(el)) {
+            clauses.insert(lp->args_[lp->loop_name_.empty() ? 0 : 1]);
+            if (!lp->loop_name_.empty()) {
+                locals.insert(lp->loop_name_);
+                local_functions.insert(lp->loop_name_);
+            }
+            for (const auto& binding : lp->bindings_) {
+                binders.insert(binding.name);
+                locals.insert(binding.name->GetName());
+                if (dynamic_cast<LambdaFunc*>(binding.init)) {
+                    local_functions.insert(binding.name->GetName());
+                }
+            }
+        } else if (auto dp = dynamic_cast<DoFunc*>(el)) {
+            clauses.insert(dp->args_[0]);
+            clauses.insert(dp->args_[1]);
+            for (const auto& binding : dp->bindings_) {
+                binders.insert(binding.name);
+                locals.insert(binding.name->GetName());
+            }
+        }
+    }
+    for (auto el : reached) {
+        if (quoted.contains(el)) {
+            continue;
+        }
+        if (dynamic_cast<Set*>(el) || dynamic_cast<SetPairElem*>(el) ||
+            dynamic_cast<SpawnFunc*>(el) || dynamic_cast<YieldFunc*>(el) ||
+            dynamic_cast<ChannelOperation*>(el) || dynamic_cast<MakeChannel*>(el) ||
+            dynamic_cast<MakeHashTable*>(el) || dynamic_cast<LoadFunc*>(el) ||
+            dynamic_cast<ReadFunc*>(el) || dynamic_cast<MemoStats*>(el) ||
+            dynamic_cast<DefineMemoized*>(el)) {
+            return false;
+        }
+        if (auto op = dynamic_cast<HashTableOperation*>(el); op && op->IsMutating()) {
+            return false;
+        }
+        if (clauses.contains(el)) {
+            continue;
+        }
+        if (auto fh = dynamic_cast<FunctionHolder*>(el)) {
+            auto head = dynamic_cast<Holder*>(fh->func_);
+            if (!dynamic_cast<LambdaFunc*>(fh->func_) &&
+                !(head && head->Size() && binders.contains((*head)[0]))) {
+                return false;
+            }
+            continue;
+        }
+        auto hp = dynamic_cast<Holder*>(el);
+        if (!hp || !hp->Size() || binders.contains((*hp)[0])) {
+            continue;
+        }
+        auto name = static_cast<Symbol*>((*hp)[0])->GetName();
+        if (name == self || local_functions.contains(name)) {
+            continue;
+        }
+        if (locals.contains(name)) {
+            return false;
+        }
+        auto cur = scope;
+        while (cur && !cur->Contains(name)) {
+            cur = cur->Parent();
+        }
+        if (!cur) {
+            return false;
+        }
+        auto callee = dynamic_cast<LambdaFunc*>(cur->Get(name));
+        if (!callee) {
+            return false;
+        }
+        if (checked.contains(callee)) {
+            continue;
+        }
+        checked.insert(callee);
+        auto callee_scope = callee->scope_ ? callee->scope_.get() : scope;
+        if (!IsPure(callee->data_[0], std::span<Object* const>(callee->data_).subspan(1), self,
+                    callee_scope, checked)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::vector<Object*> BindingForm::Elements(Object* form, const std::string& where) {
+    std::vector<Object*> res;
+    if (auto hp = dynamic_cast<Holder*>(form)) {
+        for (size_t i = 0; i != hp->Size(); ++i) {
+            res.push_back((*hp)[i]);
+        }
+    } else if (auto fh = dynamic_cast<FunctionHolder*>(form)) {
+        res.push_back(fh->func_);
+        res.insert(res.end(), fh->args_.begin(), fh->args_.end());
+    } else if (form) {
+        auto cp = dynamic_cast<Cell*>(form);
+        while (cp) {
+            res.push_back(cp->GetFirst());
+            if (cp->GetSecond() && !dynamic_cast<Cell*>(cp->GetSecond())) {
+                throw SyntaxError("Improper list in '" + where + "'");
+            }
+            cp = static_cast<Cell*>(cp->GetSecond());
+        }
+        if (res.empty()) {
+            throw SyntaxError("Unexpected form in '" + where + "'");
+        }
+    }
+    return res;
+}
+
+std::vector<BindingForm::Binding> BindingForm::ParseBindings(Object* form,
+                                                             const std::string& where,
+                                                             bool with_step) {
+    std::vector<Binding> res;
+    for (auto el : Elements(form, where)) {
+        auto binding = Elements(el, where);
+        auto name = binding.empty() ? nullptr : dynamic_cast<Symbol*>(binding[0]);
+        if (!name || binding.size() < 2 || binding.size() > (with_step ? 3 : 2)) {
+            throw SyntaxError("Bad binding in '" + where + "'");
+        }
+        res.push_back({name, binding[1], binding.size() == 3 ? binding[2] : nullptr});
+    }
+    return res;
+}
+
+bool BindingForm::IsTrue(Object* cond, Scope* scope, const char* where) {
+    if (auto eval = CanEval(cond, scope)) {
+        cond = eval;
+    }
+    auto bp = dynamic_cast<Boolean*>(cond);
+    if (!bp) {
+        Fail(scope, ErrorKind::SYNTAX, std::string("Non-boolean arg in '") + where + "' condition");
+        return false;
+    }
+    return bp->GetValue();
+}
+
+void BindingForm::FindTailCalls(Object* expr, const std::string& name,
+                                std::vector<const Object*>* calls) {
+    if (auto hp = dynamic_cast<Holder*>(expr)) {
+        if (auto head = dynamic_cast<Symbol*>((*hp)[0]); head && head->GetName() == name) {
+            calls->push_back(hp);
+        }
+    } else if (auto ip = dynamic_cast<IfFunc*>(expr)) {
+        for (size_t i = 1; i < ip->args_.size(); ++i) {
+            FindTailCalls(ip->args_[i], name, calls);
+        }
+    } else if (auto bp = dynamic_cast<BeginFunc*>(expr); bp && !bp->args_.empty()) {
+        FindTailCalls(bp->args_.back(), name, calls);
+    }
+}
+
+size_t BindingForm::CountMentions(std::span<Object* const> body, const std::string& name) {
+    std::unordered_set<Object*> reached;
+    for (auto el : body) {
+        if (el) {
+            el->MarkAll(reached);
+        }
+    }
+    std::unordered_set<Object*> quoted;
+    for (auto el : reached) {
+        if (auto qp = dynamic_cast<Quote*>(el)) {
+            if (auto data = qp->Eval(nullptr)) {
+                data->MarkAll(quoted);
+            }
+        }
+    }
+    size_t res = 0;
+    for (auto el : reached) {
+        if (auto sp = dynamic_cast<Symbol*>(el); sp && !quoted.contains(el)) {
+            res += sp->GetName() == name;
+        }
+    }
+    return res;
+}
+
+Object* LetFunc::Eval(Scope* scope) const {
+    auto collector = scope->Collector();
+    Scope frame(scope, collector);
+    frame.SetAssigned(&assigned_);
+    if (kind_ == "let") {
+        std::vector<Object*> values;
+        for (const auto& binding : bindings_) {
+            values.push_back(EvalExpr(binding.init, scope));
+            if (collector->Failed()) {
+                return nullptr;
+            }
+        }
+        for (size_t i = 0; i != bindings_.size(); ++i) {
+            frame.Set(bindings_[i].name->GetName(), values[i]);
+        }
+        if (!loop_name_.empty()) {
+            return Loop(&frame);
+        }
+    } else if (kind_ == "let*") {
+        for (const auto& binding : bindings_) {
+            auto value = EvalExpr(binding.init, &frame);
+            if (collector->Failed()) {
+                return nullptr;
+            }
+            frame.Set(binding.name->GetName(), value);
+        }
+    } else {
+        for (const auto& binding : bindings_) {
+            frame.Set(binding.name->GetName(), nullptr);
+        }
+        for (const auto& binding : bindings_) {
+            auto value = EvalExpr(binding.init, &frame);
+            if (collector->Failed()) {
+                return nullptr;
+            }
+            frame.Set(binding.name->GetName(), value);
+        }
+        for (const auto& binding : bindings_) {
+            if (auto lambda = dynamic_cast<LambdaFunc*>(frame.Get(binding.name->GetName()))) {
+                lambda->Rebind(&frame);
+            }
+        }
+    }
+    Object* res = nullptr;
+    for (auto el : body_) {
+        res = EvalExpr(el, &frame);
+        if (collector->Failed()) {
+            return nullptr;
+        }
+    }
+    return res;
+}
+
+Object* LetFunc::Loop(Scope* frame) const {
+    auto collector = frame->Collector();
+    if (needs_function_) {
+        std::vector<Object*> params;
+        for (const auto& binding : bindings_) {
+            params.push_back(binding.name);
+        }
+        std::vector<Object*> data = {frame->ResNode<Holder>(params.begin(), params.end())};
+        if (body_.size() == 1) {
+            data.push_back(body_[0]);
+        } else {
+            data.push_back(frame->ResNode<BeginFunc>(body_.begin(), body_.end()));
+        }
+        auto lambda = frame->ResMemory(new LambdaFunc(data.begin(), data.end()));
+        frame->Set(loop_name_, lambda);
+        frame->Set(loop_name_, lambda->Eval(frame));
+    }
+    std::vector<Object**> slots;
+    for (const auto& binding : bindings_) {
+        slots.push_back(frame->Slot(binding.name->GetName()));
+    }
+    std::vector<Object*> values(bindings_.size());
+    LoopRegion region(collector);
+    while (!collector->Failed()) {
+        collector->Safepoint();
+        for (size_t i = 0; i + 1 < body_.size(); ++i) {
+            EvalExpr(body_[i], frame);
+        }
+        bool again = false;
+        auto res = EvalTail(body_.back(), frame, &values, &again);
+        if (!again) {
+            return res;
+        }
+        for (size_t i = 0; i != slots.size(); ++i) {
+            *slots[i] = values[i];
+        }
+        region.EndIteration(frame);
+    }
+    return nullptr;
+}
+
+Object* LetFunc::EvalTail(Object* expr, Scope* frame, std::vector<Object*>* values,
+                          bool* again) const {
+    while (true) {
+        if (std::find(tail_calls_.begin(), tail_calls_.end(), expr) != tail_calls_.end()) {
+            auto hp = static_cast<Holder*>(expr);
+            if (hp->Size() != bindings_.size() + 1) {
+                throw RuntimeError("Wrong count of args_ in '" + loop_name_ + "'");
+            }
+            for (size_t i = 1; i != hp->Size(); ++i) {
+                (*values)[i - 1] = EvalExpr((*hp)[i], frame);
+            }
+            *again = true;
+            return nullptr;
+        } else if (auto ip = dynamic_cast<IfFunc*>(expr)) {
+            expr = Branch(ip, frame);
+        } else if (auto bp = dynamic_cast<BeginFunc*>(expr); bp && !Sequence(bp).empty()) {
+            auto sequence = Sequence(bp);
+            for (size_t i = 0; i + 1 < sequence.size(); ++i) {
+                EvalExpr(sequence[i], frame);
+            }
+            expr = sequence.back();
+        } else {
+            return EvalExpr(expr, frame);
+        }
+    }
+}
+
+Object* DoFunc::Eval(Scope* scope) const {
+    auto collector = scope->Collector();
+    Scope frame(scope, collector);
+    frame.SetAssigned(&assigned_);
+    std::vector<Object*> values;
+    for (const auto& binding : bindings_) {
+        values.push_back(EvalExpr(binding.init, scope));
+    }
+    for (size_t i = 0; i != bindings_.size(); ++i) {
+        frame.Set(bindings_[i].name->GetName(), values[i]);
+    }
+    std::vector<Object**> slots;
+    for (const auto& binding : bindings_) {
+        slots.push_back(frame.Slot(binding.name->GetName()));
+    }
+    LoopRegion region(collector);
+    while (true) {
+        collector->Safepoint();
+        auto done = IsTrue(test_, &frame, "do");
+        if (collector->Failed()) {
+            return nullptr;
+        }
+        if (done) {
+            Object* res = nullptr;
+            for (auto el : results_) {
+                res = EvalExpr(el, &frame);
+            }
+            return res;
+        }
+        for (auto el : commands_) {
+            EvalExpr(el, &frame);
+        }
+        for (size_t i = 0; i != bindings_.size(); ++i) {
+            values[i] = bindings_[i].step ? EvalExpr(bindings_[i].step, &frame) : *slots[i];
+        }
+        if (collector->Failed()) {
+            return nullptr;
+        }
+        for (size_t i = 0; i != slots.size(); ++i) {
+            *slots[i] = values[i];
+        }
+        region.EndIteration(&frame);
+    }
+}
+
+Object* ReadFunc::Eval(Scope* scope) const {
+    if (args_.size() != 1) {
+        return Fail(scope, ErrorKind::SYNTAX, "Wrong count of args_ in 'read'");
+    }
+    auto value = args_[0];
+    if (auto eval = CanEval(value, scope)) {
+        value = eval;
+    }
+    auto sp = dynamic_cast<String*>(value);
+    if (!sp) {
+        return Fail(scope, ErrorKind::RUNTIME, "Unexpected argument in 'read'");
+    }
+    auto text = sp->GetText().ToString();
+    Tokenizer tokenizer{std::string_view(text)};
+    try {
+        return ReadDatum(&tokenizer, scope->Collector());
+    } catch (const SyntaxError& e) {
+        return Fail(scope, ErrorKind::SYNTAX, e.what());
+    }
+}
+
+Object* LoadFunc::Eval(Scope* scope) const {
+    if (args_.size() != 1) {
+        return Fail(scope, ErrorKind::SYNTAX, "Wrong count of args_ in 'load'");
+    }
+    auto value = args_[0];
+    if (auto eval = CanEval(value, scope)) {
+        value = eval;
+    }
+    auto sp = dynamic_cast<String*>(value);
+    if (!sp) {
+        return Fail(scope, ErrorKind::RUNTIME, "Unexpected argument in 'load'");
+    }
+    auto collector = scope->Collector();
+    std::vector<Object*> forms;
+    try {
+        forms = ModuleCache::Shared().Read(sp->GetText().ToString(), collector,
+                                           std::max(1u, std::thread::hardware_concurrency()));
+    } catch (const SyntaxError& e) {
+        return Fail(scope, ErrorKind::SYNTAX, e.what());
+    } catch (const RuntimeError& e) {
+        return Fail(scope, ErrorKind::RUNTIME, e.what());
+    }
+    auto root = scope->Root();
+    Object* res = nullptr;
+    for (auto form : forms) {
+        res = form ? form->Eval(root) : nullptr;
+        if (collector->Failed()) {
+            return nullptr;
+        }
+    }
+    return res;
+}
@@ -1,11 +1,32 @@
 #pragma once
 
+#include <array>
+#include <type_traits>
+
+#include "compiled.h"
+#include "hash_table.h"
 #include "object.h"
+#include "scheduler.h"
+#include "trace.h"
 
-Object* EvalBoolValue(bool);
+Boolean* EvalBoolValue(bool);
+// Shared #t and #f, they are immutable and belong to no collector.
+Object* GetBoolConstant(bool);
+// Evaluates arg if needed and returns its value, fails when it is not a number.
+int64_t GetNumberArg(Object*, Scope*, const char* where);
+// Table through which compiled code reaches collector, see compiler.h.
+CompiledRuntime MakeCompiledRuntime(GarbageCollector* collector);
+// Reports an error through the collector of scope, see GarbageCollector::Fail.
+Object* Fail(Scope*, ErrorKind, const std::string& message);
 Object* CanEval(Object*, Scope*);
-bool CheckAllNumbers(const std::vector<Object*>&, Scope*, std::vector<Object*>&);
+bool CheckAllNumbers(std::span<Object* const>, Scope*, std::vector<Object*>&);
 bool MakeLogicOperation(bool, bool, bool);
+void FindNames(Object*, std::unordered_set<std::string>&);
+// Names which set! forms in obj assign, including those of nested lambdas.
+void FindAssigned(Object*, std::unordered_set<std::string>&);
+// Copy of the pairs of a list, nested lists included, other elements are shared. A memoized
+// function keeps and returns copies, so changing a list it returned changes no other result.
+Object* CopyCells(Object*, GarbageCollector*);
 
 class Function : public Object {
 public:
@@ -13,41 +34,142 @@ public:
     std::string Print(bool) const override {
         throw NameError("Cannot be printed");
     }
+    bool IsExpression() const override {
+        return true;
+    }
 };
 
 class LambdaFunc : public Function {
 public:
     template <class It>
     LambdaFunc(It begin, It end) : data_(begin, end) {
+        std::unordered_set<std::string> names;
+        for (size_t i = 1; i < data_.size(); ++i) {
+            FindNames(data_[i], names);
+        }
+        if (auto params = data_[0]) {
+            std::unordered_set<std::string> bound;
+            FindNames(params, bound);
+            for (const auto& name : bound) {
+                names.erase(name);
+            }
+        }
+        free_names_.assign(names.begin(), names.end());
+        std::unordered_set<std::string> assigned;
+        for (size_t i = 1; i < data_.size(); ++i) {
+            FindAssigned(data_[i], assigned);
+        }
+        if (!assigned.empty()) {
+            using Names = const std::unordered_set<std::string>;
+            assigned_ = std::make_shared<Names>(std::move(assigned));
+        }
     }
     template <class It>
     Object* FindVal(Scope* s, It begin, It end);
 
+    // Evaluating a lambda expression makes a new closure which keeps only the free variables
+    // of the body, a closure itself evaluates to itself.
     Object* Eval(Scope* gotten_scope) const override {
-        if (!scope_) {
-            scope_ = gotten_scope->MakeScope();
+        if (scope_) {
+            return std::remove_const_t<Object*>(this);
+        }
+        auto closure =
+            static_cast<LambdaFunc*>(gotten_scope->ResMemory(new LambdaFunc(data_, assigned_)));
+        closure->scope_ = gotten_scope->MakeClosure(free_names_);
+        for (const auto& name : free_names_) {
+            if (closure->scope_->Contains(name) && closure->scope_->Get(name) == this) {
+                closure->scope_->Set(name, closure);
+            }
         }
-        return std::remove_const_t<Object*>(this);
+        return closure;
     }
     void MarkAll(std::unordered_set<Object*>& need) const override {
+        if (need.contains(std::remove_const_t<Object*>(this))) {
+            return;
+        }
         need.insert(std::remove_const_t<Object*>(this));
         for (auto el : data_) {
             if (el) {
                 el->MarkAll(need);
             }
         }
+        if (scope_) {
+            scope_->FindAllObjects(need);
+        }
+        if (memo_) {
+            memo_->MarkAll(need);
+        }
+    }
+    void Save(ImageWriter* writer) const override {
+        writer->WriteLambda(this, data_, scope_.get(), memo_ ? memo_->Capacity() : 0);
+    }
+    const MemoCache* Memo() const {
+        return memo_.get();
+    }
+    // Captured variables, nullptr for a lambda expression which was not evaluated.
+    const Scope* Closure() const {
+        return scope_.get();
+    }
+    // The captured variables, the body and cached results.
+    void CollectRefs(std::vector<Object*>& refs) const override {
+        if (scope_) {
+            scope_->ForEachBinding([&refs](const std::string&, Object* obj) {
+                if (obj) {
+                    refs.push_back(obj);
+                }
+            });
+        }
+        std::unordered_set<Object*> reached;
+        for (auto el : data_) {
+            if (el) {
+                el->MarkAll(reached);
+            }
+        }
+        if (memo_) {
+            memo_->MarkAll(reached);
+        }
+        refs.insert(refs.end(), reached.begin(), reached.end());
+    }
+    // Lets calls with arity arguments run entry, returns false when the function has another
+    // arity or more than one body expression.
+    bool SetCompiled(CompiledEntry entry, size_t arity);
+    // Points the captured variables which frame binds at their current values, so functions
+    // made by letrec see each other.
+    void Rebind(Scope* frame) {
+        if (!scope_) {
+            return;
+        }
+        for (auto& [name, value] : scope_->objects_) {
+            // A box is shared with the frame and already holds the value.
+            if (frame->Contains(name) && !Box::Is(value)) {
+                scope_->collector_->NoteStore(scope_->birth_);
+                value = frame->Get(name);
+            }
+        }
     }
 
 private:
-    mutable Scope* scope_ = nullptr;
+    LambdaFunc(const std::vector<Object*>& data,
+               std::shared_ptr<const std::unordered_set<std::string>> assigned)
+        : data_(data), assigned_(std::move(assigned)) {
+    }
+
+    std::unique_ptr<Scope> scope_;
+    std::unique_ptr<MemoCache> memo_;
     std::vector<Object*> data_;
+    std::vector<std::string> free_names_;
+    // Names the body assigns, shared by the closures made from the expression.
+    std::shared_ptr<const std::unordered_set<std::string>> assigned_;
+    CompiledEntry compiled_ = nullptr;
+    size_t compiled_arity_ = 0;
     friend class FunctionHolder;
+    friend class DefineMemoized;
+    friend class ImageReader;
 };
 
 class FunctionHolder : public Object {
 public:
-    template <class Iterator>
-    FunctionHolder(Object* ptr, Iterator begin, Iterator end) : func_(ptr), args_(begin, end) {
+    FunctionHolder(Object* ptr, std::span<Object*> args) : func_(ptr), args_(args) {
     }
     Object* Eval(Scope* scope) const override {
         if (auto lambda = dynamic_cast<LambdaFunc*>(func_)) {
@@ -57,11 +179,14 @@ public:
         if (auto fh = dynamic_cast<FunctionHolder*>(func_)) {
             auto function = dynamic_cast<Function*>((fh->Eval(scope)));
             if (!function) {
-                throw NameError("Unexpected argument in evaluating");
+                return Fail(scope, ErrorKind::NAME, "Unexpected argument in evaluating");
             }
             return function->Eval(scope);
         }
         auto res = static_cast<Function*>(func_)->Eval(scope);
+        if (scope->Collector()->Failed()) {
+            return nullptr;
+        }
         if (auto other_lambda = dynamic_cast<LambdaFunc*>(res)) {
             std::vector<Object*> arg;
             return other_lambda->FindVal(scope, arg.begin(), arg.end());
@@ -79,36 +204,54 @@ public:
             }
         }
     }
+    void Save(ImageWriter* writer) const override {
+        writer->WriteCall(this, func_, args_);
+    }
 
 private:
     Object* func_;
-    std::vector<Object*> args_;
+    std::span<Object*> args_;
     friend class Define;
+    friend class BindingForm;
+    friend class DefineMemoized;
 };
 
 class Holder : public Object {
 public:
-    template <class Iterator>
-    Holder(Iterator begin, Iterator end) : data_(begin, end) {
+    Holder(std::span<Object*> data) : data_(data) {
     }
     void Reload(const std::vector<Object*>& added_args, Scope* scope) {
         std::string name = static_cast<Symbol*>(data_[0])->GetName();
-        auto first = scope->ResMemory(new Holder(data_.begin() + 1, data_.end()));
+        auto first = scope->ResNode<Holder>(data_.begin() + 1, data_.end());
         std::vector<Object*> obj = {first};
         for (auto el : added_args) {
             obj.push_back(el);
         }
-        scope->Set(name, scope->ResMemory(new LambdaFunc(obj.begin(), obj.end())));
-        static_cast<LambdaFunc*>(scope->Get(name))->Eval(scope);
+        auto lambda = scope->ResMemory(new LambdaFunc(obj.begin(), obj.end()));
+        scope->Set(name, lambda);
+        scope->Set(name, lambda->Eval(scope));
     }
     Object* operator[](size_t index) {
         return data_[index];
     }
+    const Object* operator[](size_t index) const {
+        return data_[index];
+    }
     size_t Size() const {
         return data_.size();
     }
+    bool IsExpression() const override {
+        return true;
+    }
     Object* Eval(Scope* scope) const override {
-        auto func = scope->Get(static_cast<Symbol*>(data_[0])->GetName());
+        TraceSpan span(TraceKind::CALL, [this] {
+            auto sp = dynamic_cast<Symbol*>(data_[0]);
+            return sp ? sp->TraceName() : "lambda";
+        });
+        auto func = data_[0]->Eval(scope);
+        if (scope->Collector()->Failed()) {
+            return nullptr;
+        }
         func = func->Eval(scope);
         return static_cast<LambdaFunc*>(func)->FindVal(scope, data_.begin() + 1, data_.end());
     }
@@ -130,79 +273,117 @@ public:
             }
         }
     }
+    void Save(ImageWriter* writer) const override {
+        writer->WriteHolder(this, data_);
+    }
 
 private:
-    std::vector<Object*> data_;
+    std::span<Object*> data_;
     friend class Define;
 };
 
 template <class It>
 Object* LambdaFunc::FindVal(Scope* s, It begin, It end) {
+    // The caller's collector, a fork allocates its frames in its own heap.
+    auto collector = s->Collector();
+    collector->Safepoint();
     auto cur = begin;
-    auto my_scope = scope_->MakeScope();
-    size_t i = 0;
+    Scope frame(scope_.get(), collector);
+    frame.SetAssigned(assigned_.get());
+    Trace(TraceKind::SCOPE, TracePhase::MARK, "frame", 1);
+    auto my_scope = &frame;
+    std::vector<Object*> values;
+    for (; cur != end; ++cur) {
+        values.push_back((*cur)->Eval(s));
+        if (collector->Failed()) {
+            return nullptr;
+        }
+    }
+    // Results of a function shared with forks are looked up but not added.
+    bool shared = scope_->collector_->Frozen();
+    if (memo_) {
+        bool found;
+        auto res = shared ? memo_->Peek(values, &found) : memo_->Find(values, &found);
+        if (found) {
+            return CopyCells(res, collector);
+        }
+    }
+    if (compiled_ && values.size() == compiled_arity_) {
+        // On a value the compiled code does not handle the body is evaluated as usual.
+        try {
+            return compiled_(MakeCompiledRuntime(collector), values.data());
+        } catch (const CompiledFallback&) {
+        }
+    }
     auto holder = static_cast<Holder*>(data_[0]);
-    while (cur != end) {
-        my_scope->Set(static_cast<Symbol*>((*holder)[i])->GetName(), (*cur)->Eval(s));
-        ++cur;
-        ++i;
+    for (size_t i = 0; i != values.size(); ++i) {
+        my_scope->Set(static_cast<Symbol*>((*holder)[i])->GetName(), values[i]);
     }
     if (data_.size() == 3) {
         auto symbol = dynamic_cast<Symbol*>(data_[1]->Eval(my_scope));
+        if (collector->Failed()) {
+            return nullptr;
+        }
         if (symbol) {
             scope_->SetIfNotExist(symbol->GetName(), my_scope->Get(symbol->GetName()));
         }
     }
-    return data_.size() == 3 ? data_[2]->Eval(my_scope) : data_[1]->Eval(my_scope);
+    auto res = data_.size() == 3 ? data_[2]->Eval(my_scope) : data_[1]->Eval(my_scope);
+    if (memo_ && !shared && !collector->Failed()) {
+        collector->NoteStore();
+        for (auto& value : values) {
+            value = CopyCells(value, collector);
+        }
+        memo_->Insert(values, CopyCells(res, collector));
+    }
+    return res;
 }
 
+// Every operator is a separate class chosen when the form is parsed, so evaluation does not
+// branch on the operator.
+template <size_t kIndex>
 struct ComparingStructure {
-    ComparingStructure(size_t ind) : index(ind) {
-    }
+    static constexpr const char* kName = std::array{"<", ">", "<=", ">=", "="}[kIndex];
 
-    bool operator()(int64_t f, int64_t s) {
-        if (index == 0) {
+    bool operator()(int64_t f, int64_t s) const {
+        if constexpr (kIndex == 0) {
             return f < s;
-        } else if (index == 1) {
+        } else if constexpr (kIndex == 1) {
             return f > s;
-        } else if (index == 2) {
+        } else if constexpr (kIndex == 2) {
             return f <= s;
-        } else if (index == 3) {
+        } else if constexpr (kIndex == 3) {
             return f >= s;
-        } else if (index == 4) {
-            return f == s;
         } else {
-            throw NameError("Unexpected index");
+            static_assert(kIndex == 4);
+            return f == s;
         }
     }
-
-    size_t index;
 };
 
+template <size_t kIndex>
 class GoodOperatorFunc : public Function {
 public:
-    template <class Iterator>
-    GoodOperatorFunc(size_t ind, Iterator begin, Iterator end) : args_(begin, end), index_(ind) {
+    GoodOperatorFunc(std::span<Object*> args) : args_(args) {
     }
 
     Object* Eval(Scope* scope) const override {
         if (args_.empty()) {
-            return scope->ResMemory(EvalBoolValue(true));
+            return GetBoolConstant(true);
         }
-        std::vector<Object*> eval_args;
-        if (!CheckAllNumbers(args_, scope, eval_args)) {
-            throw RuntimeError("Unexpected argument in comparing");
-        }
-        auto comparator = ComparingStructure(index_);
-        int64_t prev_val = static_cast<Number*>(eval_args[0])->GetValue();
+        ComparingStructure<kIndex> comparator;
+        auto collector = scope->Collector();
+        int64_t prev_val = GetNumberArg(args_[0], scope, "comparing");
         bool res = true;
         for (size_t i = 1; i != args_.size(); ++i) {
-            Object* ptr = args_[i];
-            auto cur_val = static_cast<Number*>(ptr);
-            res &= comparator(prev_val, cur_val->GetValue());
-            prev_val = cur_val->GetValue();
+            auto cur_val = GetNumberArg(args_[i], scope, "comparing");
+            if (collector->Failed()) {
+                return nullptr;
+            }
+            res &= comparator(prev_val, cur_val);
+            prev_val = cur_val;
         }
-        return scope->ResMemory(EvalBoolValue(res));
+        return GetBoolConstant(res);
     }
     void MarkAll(std::unordered_set<Object*>& need) const override {
         need.insert(std::remove_const_t<Object*>(this));
@@ -212,47 +393,43 @@ public:
             }
         }
     }
+    void Save(ImageWriter* writer) const override {
+        writer->WriteForm(this, ComparingStructure<kIndex>::kName, args_);
+    }
 
 private:
-    std::vector<Object*> args_;
-    size_t index_;
+    std::span<Object*> args_;
 };
 
+template <size_t kIndex>
 struct OperatorHelper {
-    OperatorHelper(const std::string& s) {
-        std::vector<std::string> val = {"+", "*", "-", "/"};
-        for (size_t i = 0; i != val.size(); ++i) {
-            if (s == val[i]) {
-                index = i;
-            }
-        }
-    }
+    static constexpr const char* kName = std::array{"+", "*", "-", "/"}[kIndex];
+
     int64_t operator()(int64_t f, int64_t s) const {
-        if (index == 0) {
+        if constexpr (kIndex == 0) {
             return f + s;
-        } else if (index == 1) {
+        } else if constexpr (kIndex == 1) {
             return f * s;
-        } else if (index == 2) {
+        } else if constexpr (kIndex == 2) {
             return f - s;
-        } else if (index == 3) {
+        } else {
+            static_assert(kIndex == 3);
             return f / s;
         }
-        throw NameError("Unexpected error in operators");
     }
     int64_t DefaultVal() const {
-        if (index <= 1) {
-            return index;
+        if constexpr (kIndex <= 1) {
+            return kIndex;
+        } else {
+            throw RuntimeError("No default value in such operation");
         }
-        throw RuntimeError("No default value in such operation");
     }
-
-    size_t index;
 };
 
+template <size_t kIndex>
 class AddSubOthersFunc : public Function {
 public:
-    template <class It>
-    AddSubOthersFunc(const std::string& s, It begin, It end) : operation_(s), args_(begin, end) {
+    AddSubOthersFunc(std::span<Object*> args) : args_(args) {
     }
 
     Object* Eval(Scope* scope) const override {
@@ -260,13 +437,18 @@ public:
             int res = operation_.DefaultVal();
             return scope->ResMemory(new Number{res});
         }
-        std::vector<Object*> eval_args;
-        if (!CheckAllNumbers(args_, scope, eval_args)) {
-            throw RuntimeError("Unexpected argument in operation('+', '-', '*', '/')");
+        const char* where = "operation('+', '-', '*', '/')";
+        auto collector = scope->Collector();
+        int64_t res = GetNumberArg(args_[0], scope, where);
+        for (size_t i = 1; i != args_.size(); ++i) {
+            auto value = GetNumberArg(args_[i], scope, where);
+            if (collector->Failed()) {
+                return nullptr;
+            }
+            res = operation_(res, value);
         }
-        int64_t res = static_cast<Number*>(eval_args[0])->GetValue();
-        for (size_t i = 1; i != eval_args.size(); ++i) {
-            res = operation_(res, static_cast<Number*>(eval_args[i])->GetValue());
+        if (collector->Failed()) {
+            return nullptr;
         }
         return scope->ResMemory(new Number(res));
     }
@@ -278,25 +460,74 @@ public:
             }
         }
     }
+    void Save(ImageWriter* writer) const override {
+        writer->WriteForm(this, OperatorHelper<kIndex>::kName, args_);
+    }
 
 private:
-    OperatorHelper operation_;
-    std::vector<Object*> args_;
+    OperatorHelper<kIndex> operation_;
+    std::span<Object*> args_;
+};
+
+// Fused node for an operator applied to an operand and a number, the shape of most tests and
+// steps in loops and recursion: (= n 0), (- n 1), (+ i 1). The number is kept unboxed and a
+// variable operand is looked up without going through the general argument path.
+template <class Operation>
+class ImmediateOperation : public Function {
+public:
+    ImmediateOperation(std::span<Object*> args)
+        : args_(args),
+          symbol_(dynamic_cast<Symbol*>(args[0])),
+          immediate_(static_cast<Number*>(args[1])->GetValue()) {
+    }
+
+    Object* Eval(Scope* scope) const override {
+        const char* where = kCompare ? "comparing" : "operation('+', '-', '*', '/')";
+        auto np = symbol_ ? dynamic_cast<Number*>(symbol_->Symbol::Eval(scope)) : nullptr;
+        int64_t value = np ? np->GetValue() : GetNumberArg(args_[0], scope, where);
+        if (scope->Collector()->Failed()) {
+            return nullptr;
+        }
+        if constexpr (kCompare) {
+            return GetBoolConstant(operation_(value, immediate_));
+        } else {
+            return scope->ResMemory(new Number(operation_(value, immediate_)));
+        }
+    }
+    void MarkAll(std::unordered_set<Object*>& need) const override {
+        need.insert(std::remove_const_t<Object*>(this));
+        for (auto el : args_) {
+            if (el) {
+                el->MarkAll(need);
+            }
+        }
+    }
+    void Save(ImageWriter* writer) const override {
+        writer->WriteForm(this, Operation::kName, args_);
+    }
+
+private:
+    static constexpr bool kCompare =
+        std::is_same_v<std::invoke_result_t<Operation, int64_t, int64_t>, bool>;
+
+    std::span<Object*> args_;
+    const Symbol* symbol_;
+    int64_t immediate_;
+    Operation operation_;
 };
 
 class MinMax : public Function {
 public:
-    template <class It>
-    MinMax(const std::string& func, It begin, It end) : is_max_(func == "max"), args_(begin, end) {
+    MinMax(const std::string& func, std::span<Object*> args) : is_max_(func == "max"), args_(args) {
     }
 
     Object* Eval(Scope* scope) const override {
         if (args_.empty()) {
-            throw RuntimeError("Empty arg list in min/max");
+            return Fail(scope, ErrorKind::RUNTIME, "Empty arg list in min/max");
         }
         std::vector<Object*> eval_args;
         if (!CheckAllNumbers(args_, scope, eval_args)) {
-            throw RuntimeError("Unexpected argument in min/max");
+            return Fail(scope, ErrorKind::RUNTIME, "Unexpected argument in min/max");
         }
         int64_t def =
             (is_max_) ? std::numeric_limits<int64_t>::min() : std::numeric_limits<int64_t>::max();
@@ -314,21 +545,23 @@ public:
             }
         }
     }
+    void Save(ImageWriter* writer) const override {
+        writer->WriteForm(this, is_max_ ? "max" : "min", args_);
+    }
 
 private:
     bool is_max_;
-    std::vector<Object*> args_;
+    std::span<Object*> args_;
 };
 
 class AbsFunc : public Function {
 public:
-    template <class It>
-    AbsFunc(It begin, It end) : args_(begin, end) {
+    AbsFunc(std::span<Object*> args) : args_(args) {
     }
 
     Object* Eval(Scope* scope) const override {
         if (args_.size() != 1) {
-            throw RuntimeError("Wrong number of arguments in 'abs'");
+            return Fail(scope, ErrorKind::RUNTIME, "Wrong number of arguments in 'abs'");
         }
         Object* eval_el = args_[0];
         if (auto eval = CanEval(args_[0], scope)) {
@@ -337,7 +570,7 @@ public:
         if (auto number = dynamic_cast<Number*>(eval_el)) {
             return scope->ResMemory(new Number(std::abs(number->GetValue())));
         }
-        throw RuntimeError("Unexpected argument in 'abs'");
+        return Fail(scope, ErrorKind::RUNTIME, "Unexpected argument in 'abs'");
     }
     void MarkAll(std::unordered_set<Object*>& need) const override {
         need.insert(std::remove_const_t<Object*>(this));
@@ -347,29 +580,31 @@ public:
             }
         }
     }
+    void Save(ImageWriter* writer) const override {
+        writer->WriteForm(this, "abs", args_);
+    }
 
 private:
-    std::vector<Object*> args_;
+    std::span<Object*> args_;
 };
 
 class BoolNotFunc : public Function {
 public:
-    template <class It>
-    BoolNotFunc(It begin, It end) : args_(begin, end) {
+    BoolNotFunc(std::span<Object*> args) : args_(args) {
     }
 
     Object* Eval(Scope* scope) const override {
         if (args_.size() != 1) {
-            throw RuntimeError("Incorrect number of arguments in 'not'");
+            return Fail(scope, ErrorKind::RUNTIME, "Incorrect number of arguments in 'not'");
         }
         Object* eval_el = args_[0];
         if (auto eval = CanEval(args_[0], scope)) {
             eval_el = eval;
         }
         if (auto boolean = dynamic_cast<Boolean*>(eval_el)) {
-            return scope->ResMemory(EvalBoolValue(boolean->GetVal() == "#f"));
+            return GetBoolConstant(!boolean->GetValue());
         }
-        return scope->ResMemory(EvalBoolValue(false));
+        return GetBoolConstant(false);
     }
     void MarkAll(std::unordered_set<Object*>& need) const override {
         need.insert(std::remove_const_t<Object*>(this));
@@ -379,21 +614,23 @@ public:
             }
         }
     }
+    void Save(ImageWriter* writer) const override {
+        writer->WriteForm(this, "not", args_);
+    }
 
 private:
-    std::vector<Object*> args_;
+    std::span<Object*> args_;
 };
 
 class BoolLogicOperation : public Function {
 public:
-    template <class It>
-    BoolLogicOperation(const std::string& s, It begin, It end)
-        : is_and_(s == "and"), args_(begin, end) {
+    BoolLogicOperation(const std::string& s, std::span<Object*> args)
+        : is_and_(s == "and"), args_(args) {
     }
 
     Object* Eval(Scope* scope) const override {
         if (args_.empty()) {
-            return scope->ResMemory(EvalBoolValue(is_and_));
+            return GetBoolConstant(is_and_);
         }
         bool def = is_and_;
         for (size_t i = 0; i != args_.size(); ++i) {
@@ -404,8 +641,11 @@ public:
             if (auto eval = CanEval(cur, scope)) {
                 cur = eval;
             }
+            if (scope->Collector()->Failed()) {
+                return nullptr;
+            }
             if (auto cur_val = dynamic_cast<Boolean*>(&*cur)) {
-                def = MakeLogicOperation(is_and_, def, cur_val->GetVal() == "#t");
+                def = MakeLogicOperation(is_and_, def, cur_val->GetValue());
             } else {
                 def = MakeLogicOperation(is_and_, def, true);
             }
@@ -413,7 +653,7 @@ public:
                 break;
             }
         }
-        return scope->ResMemory(EvalBoolValue(def));
+        return GetBoolConstant(def);
     }
     void MarkAll(std::unordered_set<Object*>& need) const override {
         need.insert(std::remove_const_t<Object*>(this));
@@ -423,44 +663,115 @@ public:
             }
         }
     }
+    void Save(ImageWriter* writer) const override {
+        writer->WriteForm(this, is_and_ ? "and" : "or", args_);
+    }
 
 private:
     bool is_and_;
-    std::vector<Object*> args_;
+    std::span<Object*> args_;
 };
 
 class IsType : public Function {
 public:
-    template <class It>
-    IsType(const std::string& s, It begin, It end) : name_(s), args_(begin, end) {
+    IsType(const std::string& s, std::span<Object*> args) : name_(s), args_(args) {
     }
 
     Object* Eval(Scope* scope) const override {
         if (args_.size() != 1) {
-            throw RuntimeError("Wrong count of args_ in '<type>?' func");
+            return Fail(scope, ErrorKind::RUNTIME, "Wrong count of args_ in '<type>?' func");
         }
-        auto ptr = args_[0];
-        if (auto quote = dynamic_cast<Quote*>(ptr)) {
-            ptr = quote->Eval(scope);
+        auto ptr = args_[0] && args_[0]->IsExpression() ? args_[0]->Eval(scope) : args_[0];
+        if (scope->Collector()->Failed()) {
+            return nullptr;
         }
         if (!ptr) {
-            return scope->ResMemory(EvalBoolValue(name_ == "null?" || name_ == "list?"));
+            return GetBoolConstant(name_ == "null?" || name_ == "list?");
         } else if (name_ == "symbol?" && dynamic_cast<Symbol*>(ptr)) {
-            return scope->ResMemory(EvalBoolValue(true));
+            return GetBoolConstant(true);
         } else if (auto cell = dynamic_cast<Cell*>(ptr)) {
-            bool is_list = cell->IsList();
+            bool is_list = cell->IsList(scope->Collector());
             if ((is_list && name_ == "list?") || (!is_list && name_ == "pair?")) {
-                return scope->ResMemory(EvalBoolValue(true));
+                return GetBoolConstant(true);
             }
             if (cell->CheckListAndPair() && (name_ == "list?" || name_ == "pair?")) {
-                return scope->ResMemory(EvalBoolValue(true));
+                return GetBoolConstant(true);
             }
         } else if (name_ == "number?" && dynamic_cast<Number*>(ptr)) {
-            return scope->ResMemory(EvalBoolValue(true));
+            return GetBoolConstant(true);
         } else if (name_ == "boolean?" && dynamic_cast<Boolean*>(ptr)) {
-            return scope->ResMemory(EvalBoolValue(true));
+            return GetBoolConstant(true);
+        }
+        return GetBoolConstant(false);
+    }
+    void MarkAll(std::unordered_set<Object*>& need) const override {
+        need.insert(std::remove_const_t<Object*>(this));
+        for (auto el : args_) {
+            if (el) {
+                el->MarkAll(need);
+            }
         }
-        return scope->ResMemory(EvalBoolValue(false));
+    }
+    void Save(ImageWriter* writer) const override {
+        writer->WriteForm(this, name_, args_);
+    }
+
+private:
+    std::string name_;
+    std::span<Object*> args_;
+};
+
+class StringOperation : public Function {
+public:
+    StringOperation(const std::string& s, std::span<Object*> args) : name_(s), args_(args) {
+    }
+
+    Object* Eval(Scope* scope) const override {
+        std::vector<const Rope*> texts;
+        std::vector<int64_t> numbers;
+        for (auto el : args_) {
+            auto value = el;
+            if (auto eval = CanEval(el, scope)) {
+                value = eval;
+            }
+            if (auto sp = dynamic_cast<String*>(value); sp && numbers.empty()) {
+                texts.push_back(&sp->GetText());
+            } else if (auto np = dynamic_cast<Number*>(value); np && name_ == "substring") {
+                numbers.push_back(np->GetValue());
+            } else {
+                return Fail(scope, ErrorKind::RUNTIME, "Unexpected argument in '" + name_ + "'");
+            }
+        }
+        if (name_ == "string-append") {
+            Rope res;
+            for (auto text : texts) {
+                res = res.Append(*text);
+            }
+            return scope->ResMemory(new String(std::move(res)));
+        } else if (name_ == "string=?") {
+            bool res = true;
+            for (size_t i = 1; i < texts.size(); ++i) {
+                res = res && *texts[i - 1] == *texts[i];
+            }
+            return GetBoolConstant(res);
+        }
+        if (texts.size() != 1 ||
+            (name_ == "substring" && (numbers.empty() || numbers.size() > 2))) {
+            return Fail(scope, ErrorKind::RUNTIME, "Wrong count of args_ in '" + name_ + "'");
+        }
+        auto text = texts[0];
+        if (name_ == "string-length") {
+            return scope->ResMemory(new Number(text->Length()));
+        } else if (name_ == "string->symbol") {
+            return scope->ResMemory(new Symbol(text->ToString()));
+        }
+        int64_t length = text->Length();
+        int64_t start = numbers[0];
+        int64_t end = numbers.size() == 2 ? numbers[1] : length;
+        if (start < 0 || start > end || end > length) {
+            return Fail(scope, ErrorKind::RUNTIME, "Index out of range in 'substring'");
+        }
+        return scope->ResMemory(new String(text->Substr(start, end - start)));
     }
     void MarkAll(std::unordered_set<Object*>& need) const override {
         need.insert(std::remove_const_t<Object*>(this));
@@ -470,22 +781,73 @@ public:
             }
         }
     }
+    void Save(ImageWriter* writer) const override {
+        writer->WriteForm(this, name_, args_);
+    }
 
 private:
     std::string name_;
-    std::vector<Object*> args_;
+    std::span<Object*> args_;
+};
+
+// (read "text") is the first datum of the text. Lists in it stay lists and are never turned
+// into calls.
+class ReadFunc : public Function {
+public:
+    ReadFunc(std::span<Object*> args) : args_(args) {
+    }
+
+    Object* Eval(Scope* scope) const override;
+    void MarkAll(std::unordered_set<Object*>& need) const override {
+        need.insert(std::remove_const_t<Object*>(this));
+        for (auto el : args_) {
+            if (el) {
+                el->MarkAll(need);
+            }
+        }
+    }
+    void Save(ImageWriter* writer) const override {
+        writer->WriteForm(this, "read", args_);
+    }
+
+private:
+    std::span<Object*> args_;
+};
+
+// (load "path") evaluates the forms of a file in the global scope and returns the value of the
+// last one. Files are parsed once per process, see ModuleCache.
+class LoadFunc : public Function {
+public:
+    LoadFunc(std::span<Object*> args) : args_(args) {
+    }
+
+    Object* Eval(Scope* scope) const override;
+    void MarkAll(std::unordered_set<Object*>& need) const override {
+        need.insert(std::remove_const_t<Object*>(this));
+        for (auto el : args_) {
+            if (el) {
+                el->MarkAll(need);
+            }
+        }
+    }
+    void Save(ImageWriter* writer) const override {
+        writer->WriteForm(this, "load", args_);
+    }
+
+private:
+    std::span<Object*> args_;
 };
 
 class ConsFunc : public Function {
 public:
-    template <class It>
-    ConsFunc(It begin, It end) : args_(begin, end) {
+    ConsFunc(std::span<Object*> args) : args_(args) {
     }
     Object* Eval(Scope* scope) const override {
         if (args_.size() != 2) {
-            throw RuntimeError("Wrong count of args_ in making pair function");
+            return Fail(scope, ErrorKind::RUNTIME, "Wrong count of args_ in making pair function");
         }
-        return scope->ResMemory(new Cell(args_[0]->Eval(scope), args_[1]->Eval(scope)));
+        return scope->ResMemory(
+            new Cell(args_[0]->Eval(scope), args_[1]->Eval(scope), scope->Collector()));
     }
     void MarkAll(std::unordered_set<Object*>& need) const override {
         need.insert(std::remove_const_t<Object*>(this));
@@ -495,30 +857,32 @@ public:
             }
         }
     }
+    void Save(ImageWriter* writer) const override {
+        writer->WriteForm(this, "cons", args_);
+    }
 
 private:
-    std::vector<Object*> args_;
+    std::span<Object*> args_;
 };
 
 class GetPairElemFunc : public Function {
 public:
-    template <class It>
-    GetPairElemFunc(const std::string& f, It begin, It end)
-        : is_first_(f == "car"), args_(begin, end) {
+    GetPairElemFunc(const std::string& f, std::span<Object*> args)
+        : is_first_(f == "car"), args_(args) {
     }
 
     Object* Eval(Scope* scope) const override {
         if (args_.size() != 1) {
-            throw RuntimeError("Wrong count of args_ in cutting-pair function");
+            return Fail(scope, ErrorKind::RUNTIME, "Wrong count of args_ in cutting-pair function");
         }
-        auto elem = args_[0];
-        if (!CanEval(elem, scope)) {
-            throw RuntimeError("Unexpected argument in 'car/cdr' function");
+        auto elem = CanEval(args_[0], scope);
+        if (!elem) {
+            return Fail(scope, ErrorKind::RUNTIME, "Unexpected argument in 'car/cdr' function");
         }
-        if (auto cell = dynamic_cast<Cell*>(elem->Eval(scope))) {
+        if (auto cell = dynamic_cast<Cell*>(elem)) {
             return (is_first_) ? cell->GetFirst() : cell->GetSecond();
         }
-        throw RuntimeError("Trying get element not from a pair");
+        return Fail(scope, ErrorKind::RUNTIME, "Trying get element not from a pair");
     }
     void MarkAll(std::unordered_set<Object*>& need) const override {
         need.insert(std::remove_const_t<Object*>(this));
@@ -528,16 +892,18 @@ public:
             }
         }
     }
+    void Save(ImageWriter* writer) const override {
+        writer->WriteForm(this, is_first_ ? "car" : "cdr", args_);
+    }
 
 private:
     bool is_first_;
-    std::vector<Object*> args_;
+    std::span<Object*> args_;
 };
 
 class MakeList : public Function {
 public:
-    template <class It>
-    MakeList(It begin, It end) : args_(begin, end) {
+    MakeList(std::span<Object*> args) : args_(args) {
     }
     Object* Eval(Scope* scope) const override {
         if (args_.empty()) {
@@ -553,39 +919,81 @@ public:
             }
         }
     }
+    void Save(ImageWriter* writer) const override {
+        writer->WriteForm(this, "list", args_);
+    }
 
 private:
-    std::vector<Object*> args_;
+    std::span<Object*> args_;
+};
+
+class ListLength : public Function {
+public:
+    ListLength(std::span<Object*> args) : args_(args) {
+    }
+    Object* Eval(Scope* scope) const override {
+        if (args_.size() != 1) {
+            return Fail(scope, ErrorKind::RUNTIME, "Wrong count of args_ in 'length'");
+        }
+        auto list = args_[0] && args_[0]->IsExpression() ? args_[0]->Eval(scope) : args_[0];
+        if (scope->Collector()->Failed()) {
+            return nullptr;
+        }
+        if (!list) {
+            return scope->ResMemory(new Number(0));
+        }
+        auto cell = dynamic_cast<Cell*>(list);
+        if (!cell || !cell->IsList(scope->Collector())) {
+            return Fail(scope, ErrorKind::RUNTIME, "Argument of 'length' is not a list");
+        }
+        return scope->ResMemory(new Number(cell->Length(scope->Collector())));
+    }
+    void MarkAll(std::unordered_set<Object*>& need) const override {
+        need.insert(std::remove_const_t<Object*>(this));
+        for (auto el : args_) {
+            if (el) {
+                el->MarkAll(need);
+            }
+        }
+    }
+    void Save(ImageWriter* writer) const override {
+        writer->WriteForm(this, "length", args_);
+    }
+
+private:
+    std::span<Object*> args_;
 };
 
 class GetPartList : public Function {
 public:
-    template <class It>
-    GetPartList(const std::string& s, It begin, It end)
-        : is_ref_(s == "list-ref"), args_(begin, end) {
+    GetPartList(const std::string& s, std::span<Object*> args)
+        : is_ref_(s == "list-ref"), args_(args) {
     }
 
     Object* Eval(Scope* scope) const override {
         if (args_.size() != 2) {
-            throw RuntimeError("Wrong count of args_ in cutting-list function");
+            return Fail(scope, ErrorKind::RUNTIME, "Wrong count of args_ in cutting-list function");
         }
-        auto quote = dynamic_cast<Quote*>(args_[0]);
-        auto number = dynamic_cast<Number*>(args_[1]);
-        if (!quote || !number) {
-            throw RuntimeError("Unexpected argument in cutting-list function");
+        auto list = args_[0] && args_[0]->IsExpression() ? args_[0]->Eval(scope) : args_[0];
+        if (scope->Collector()->Failed()) {
+            return nullptr;
+        }
+        auto index = GetNumberArg(args_[1], scope, "cutting-list function");
+        if (scope->Collector()->Failed()) {
+            return nullptr;
         }
-        auto cell = dynamic_cast<Cell*>(quote->Eval(scope));
-        if (!cell || !(cell->IsList())) {
-            throw RuntimeError("Quote arg is not a list");
+        auto cell = dynamic_cast<Cell*>(list);
+        if (!cell || !(cell->IsList(scope->Collector()))) {
+            return Fail(scope, ErrorKind::RUNTIME, "Cutting-list argument is not a list");
         }
         if (is_ref_) {
-            auto ref = cell->GetElement(number->GetValue());
+            auto ref = cell->GetElement(index);
             if (!ref) {
-                throw RuntimeError("Cannot get tail/ref, index is too large");
+                return Fail(scope, ErrorKind::RUNTIME, "Cannot get tail/ref, index is too large");
             }
             return ref;
         } else {
-            return cell->GetTail(number->GetValue());
+            return cell->GetTail(index, scope->Collector());
         }
     }
     void MarkAll(std::unordered_set<Object*>& need) const override {
@@ -596,36 +1004,41 @@ public:
             }
         }
     }
+    void Save(ImageWriter* writer) const override {
+        writer->WriteForm(this, is_ref_ ? "list-ref" : "list-tail", args_);
+    }
 
 private:
     bool is_ref_;
-    std::vector<Object*> args_;
+    std::span<Object*> args_;
 };
 
 class Define : public Function {
 public:
-    template <class It>
-    Define(It begin, It end) : args_(begin, end) {
+    Define(std::span<Object*> args) : args_(args) {
     }
     Object* Eval(Scope* scope) const override {
         if (args_.empty()) {
-            throw SyntaxError("Wrong count of args_ in 'define'");
+            return Fail(scope, ErrorKind::SYNTAX, "Wrong count of args_ in 'define'");
         }
         if (auto hp = dynamic_cast<Holder*>(args_[0])) {
             hp->Reload(std::vector<Object*>(args_.begin() + 1, args_.end()), scope);
             return nullptr;
         }
         if (args_.size() != 2) {
-            throw SyntaxError("Wrong count of args_ in 'define'");
+            return Fail(scope, ErrorKind::SYNTAX, "Wrong count of args_ in 'define'");
         }
         Object* value = args_[1];
         Symbol* name = dynamic_cast<Symbol*>(args_[0]);
         if (!name) {
-            throw SyntaxError("Non-symbol value as variable in 'define'");
+            return Fail(scope, ErrorKind::SYNTAX, "Non-symbol value as variable in 'define'");
         }
         if (auto eval = CanEval(args_[1], scope)) {
             value = eval;
         }
+        if (scope->Collector()->Failed()) {
+            return nullptr;
+        }
         scope->Set(name->GetName(), value);
         return nullptr;
     }
@@ -637,30 +1050,115 @@ public:
             }
         }
     }
+    void Save(ImageWriter* writer) const override {
+        writer->WriteForm(this, "define", args_);
+    }
+
+private:
+    std::span<Object*> args_;
+    friend class DefineMemoized;
+};
+
+// Binds a function like the short form of define and caches its results. The body and the
+// functions it calls by name must not mutate anything.
+class DefineMemoized : public Function {
+public:
+    DefineMemoized(std::span<Object*> args) : args_(args) {
+    }
+    Object* Eval(Scope* scope) const override {
+        auto hp = dynamic_cast<Holder*>(args_.empty() ? nullptr : args_[0]);
+        if (!hp || args_.size() < 2) {
+            return Fail(scope, ErrorKind::SYNTAX, "Wrong args_ in 'define-memoized'");
+        }
+        auto name = static_cast<Symbol*>((*hp)[0])->GetName();
+        std::unordered_set<Object*> checked;
+        if (!IsPure(hp, args_.subspan(1), name, scope, checked)) {
+            return Fail(scope, ErrorKind::SYNTAX, "Impure function in 'define-memoized'");
+        }
+        hp->Reload(std::vector<Object*>(args_.begin() + 1, args_.end()), scope);
+        auto lambda = static_cast<LambdaFunc*>(scope->Get(name));
+        lambda->memo_ = std::make_unique<MemoCache>(kMemoCapacity);
+        return nullptr;
+    }
+    void MarkAll(std::unordered_set<Object*>& need) const override {
+        need.insert(std::remove_const_t<Object*>(this));
+        for (auto el : args_) {
+            if (el) {
+                el->MarkAll(need);
+            }
+        }
+    }
+    void Save(ImageWriter* writer) const override {
+        writer->WriteForm(this, "define-memoized", args_);
+    }
 
 private:
-    std::vector<Object*> args_;
+    static constexpr size_t kMemoCapacity = 1 << 16;
+
+    // Calls are followed into global functions. A call of a variable or of a computed
+    // function may run anything, so it makes the function impure, as does a call of a name
+    // which is not defined yet.
+    static bool IsPure(Object* params, std::span<Object* const> body, const std::string& self,
+                       Scope* scope, std::unordered_set<Object*>& checked);
+
+    std::span<Object*> args_;
+};
+
+class MemoStats : public Function {
+public:
+    MemoStats(std::span<Object*> args) : args_(args) {
+    }
+    // Returns the list (hits misses).
+    Object* Eval(Scope* scope) const override {
+        if (args_.size() != 1) {
+            return Fail(scope, ErrorKind::RUNTIME, "Wrong count of args_ in 'memo-stats'");
+        }
+        auto lambda = dynamic_cast<LambdaFunc*>(args_[0]->Eval(scope));
+        if (!lambda || !lambda->Memo()) {
+            return Fail(scope, ErrorKind::RUNTIME, "Unexpected argument in 'memo-stats'");
+        }
+        auto misses = scope->ResMemory(new Cell(
+            scope->ResMemory(new Number(lambda->Memo()->Misses())), nullptr));
+        return scope->ResMemory(
+            new Cell(scope->ResMemory(new Number(lambda->Memo()->Hits())), misses));
+    }
+    void MarkAll(std::unordered_set<Object*>& need) const override {
+        need.insert(std::remove_const_t<Object*>(this));
+        for (auto el : args_) {
+            if (el) {
+                el->MarkAll(need);
+            }
+        }
+    }
+    void Save(ImageWriter* writer) const override {
+        writer->WriteForm(this, "memo-stats", args_);
+    }
+
+private:
+    std::span<Object*> args_;
 };
 
 class Set : public Function {
 public:
-    template <class It>
-    Set(It begin, It end) : args_(begin, end) {
+    Set(std::span<Object*> args) : args_(args) {
     }
 
     Object* Eval(Scope* scope) const override {
         if (args_.size() != 2) {
-            throw SyntaxError("Wrong count of args_ in 'set'");
+            return Fail(scope, ErrorKind::SYNTAX, "Wrong count of args_ in 'set'");
         }
         Object* value = args_[1];
         Symbol* name = dynamic_cast<Symbol*>(args_[0]);
         if (!name) {
-            throw SyntaxError("Non-symbol value as variable in 'set'");
+            return Fail(scope, ErrorKind::SYNTAX, "Non-symbol value as variable in 'set'");
         }
         if (auto eval = CanEval(args_[1], scope)) {
             value = eval;
         }
         name->Eval(scope);
+        if (scope->Collector()->Failed()) {
+            return nullptr;
+        }
         scope->SetExisted(name->GetName(), value);
         return nullptr;
     }
@@ -672,20 +1170,32 @@ public:
             }
         }
     }
+    void Save(ImageWriter* writer) const override {
+        writer->WriteForm(this, "set!", args_);
+    }
+    // The assigned variable, nullptr for a malformed form.
+    Symbol* Variable() const {
+        return args_.empty() ? nullptr : dynamic_cast<Symbol*>(args_[0]);
+    }
 
 private:
-    std::vector<Object*> args_;
+    std::span<Object*> args_;
 };
 
 class IfFunc : public Function {
 public:
-    template <class It>
-    IfFunc(It begin, It end) : args_(begin, end) {
+    IfFunc(std::span<Object*> args) : args_(args) {
     }
 
     Object* Eval(Scope* scope) const override {
+        auto branch = Choose(scope);
+        return branch ? branch->Eval(scope) : nullptr;
+    }
+    // Evaluates the condition and returns the expression of the taken branch, or nullptr on a
+    // kept error.
+    Object* Choose(Scope* scope) const {
         if (args_.size() < 2 || args_.size() > 3) {
-            throw SyntaxError("Wrong count of args_ in 'if' function");
+            return Fail(scope, ErrorKind::SYNTAX, "Wrong count of args_ in 'if' function");
         }
         auto cond = args_[0];
         if (auto eval = CanEval(args_[0], scope)) {
@@ -693,16 +1203,44 @@ public:
         }
         auto bp = dynamic_cast<Boolean*>(cond);
         if (!bp) {
-            throw SyntaxError("Non-boolean arg in 'if' condition");
+            return Fail(scope, ErrorKind::SYNTAX, "Non-boolean arg in 'if' condition");
         }
-        if (bp->GetVal() == "#t") {
-            return args_[1]->Eval(scope);
-        } else {
-            if (args_.size() != 3) {
+        if (bp->GetValue()) {
+            return args_[1];
+        }
+        return args_.size() == 3 ? args_[2] : nullptr;
+    }
+    void MarkAll(std::unordered_set<Object*>& need) const override {
+        need.insert(std::remove_const_t<Object*>(this));
+        for (auto el : args_) {
+            if (el) {
+                el->MarkAll(need);
+            }
+        }
+    }
+    void Save(ImageWriter* writer) const override {
+        writer->WriteForm(this, "if", args_);
+    }
+
+private:
+    std::span<Object*> args_;
+    friend class BindingForm;
+};
+
+class BeginFunc : public Function {
+public:
+    BeginFunc(std::span<Object*> args) : args_(args) {
+    }
+
+    Object* Eval(Scope* scope) const override {
+        Object* res = nullptr;
+        for (auto el : args_) {
+            res = el ? el->Eval(scope) : nullptr;
+            if (scope->Collector()->Failed()) {
                 return nullptr;
             }
-            return args_[2]->Eval(scope);
         }
+        return res;
     }
     void MarkAll(std::unordered_set<Object*>& need) const override {
         need.insert(std::remove_const_t<Object*>(this));
@@ -712,28 +1250,166 @@ public:
             }
         }
     }
+    void Save(ImageWriter* writer) const override {
+        writer->WriteForm(this, "begin", args_);
+    }
 
 private:
-    std::vector<Object*> args_;
+    std::span<Object*> args_;
+    friend class BindingForm;
+};
+
+// Common part of the let family and do: all bindings live in one frame, and the loops update
+// its slots in place instead of making a scope per iteration.
+class BindingForm : public Function {
+protected:
+    struct Binding {
+        Symbol* name;
+        Object* init;
+        Object* step;
+    };
+
+    // Elements of a parenthesized form, which the parser turns into a list, a call or a holder.
+    static std::vector<Object*> Elements(Object* form, const std::string& where);
+    // Each binding is (name init), with_step allows (name init step) as well.
+    static std::vector<Binding> ParseBindings(Object* form, const std::string& where,
+                                              bool with_step);
+    static Object* EvalExpr(Object* expr, Scope* scope) {
+        return expr ? expr->Eval(scope) : nullptr;
+    }
+    static bool IsTrue(Object* cond, Scope* scope, const char* where);
+    // FindTailCalls collects the calls of name in tail position of expr, CountMentions counts
+    // every use of name outside of quotes.
+    static void FindTailCalls(Object* expr, const std::string& name,
+                              std::vector<const Object*>* calls);
+    static size_t CountMentions(std::span<Object* const> body, const std::string& name);
+    static Object* Branch(IfFunc* ip, Scope* scope) {
+        return ip->Choose(scope);
+    }
+    static std::span<Object*> Sequence(BeginFunc* bp) {
+        return bp->args_;
+    }
+};
+
+class LetFunc : public BindingForm {
+public:
+    LetFunc(const std::string& s, std::span<Object*> args) : kind_(s), args_(args) {
+        size_t first = 0;
+        if (kind_ == "let" && !args_.empty() && dynamic_cast<Symbol*>(args_[0])) {
+            loop_name_ = static_cast<Symbol*>(args_[0])->GetName();
+            first = 1;
+        }
+        if (args_.size() < first + 2) {
+            throw SyntaxError("Wrong count of args_ in '" + kind_ + "'");
+        }
+        bindings_ = ParseBindings(args_[first], kind_, false);
+        body_ = args_.subspan(first + 1);
+        if (!loop_name_.empty()) {
+            FindTailCalls(body_.back(), loop_name_, &tail_calls_);
+            needs_function_ = CountMentions(body_, loop_name_) != tail_calls_.size();
+        }
+        for (auto el : args_) {
+            FindAssigned(el, assigned_);
+        }
+    }
+
+    Object* Eval(Scope* scope) const override;
+    void MarkAll(std::unordered_set<Object*>& need) const override {
+        need.insert(std::remove_const_t<Object*>(this));
+        for (auto el : args_) {
+            if (el) {
+                el->MarkAll(need);
+            }
+        }
+    }
+    void Save(ImageWriter* writer) const override {
+        writer->WriteForm(this, kind_, args_);
+    }
+
+private:
+    Object* Loop(Scope* frame) const;
+    // Evaluates expr in tail position, a call of the loop only stores the new values.
+    Object* EvalTail(Object* expr, Scope* frame, std::vector<Object*>* values,
+                     bool* again) const;
+
+    std::string kind_;
+    std::span<Object*> args_;
+    std::string loop_name_;
+    std::vector<Binding> bindings_;
+    std::span<Object*> body_;
+    std::vector<const Object*> tail_calls_;
+    // Set when the body uses the loop other than as a tail call, then it is a real function.
+    bool needs_function_ = false;
+    std::unordered_set<std::string> assigned_;
+    friend class DefineMemoized;
+};
+
+class DoFunc : public BindingForm {
+public:
+    DoFunc(std::span<Object*> args) : args_(args) {
+        if (args_.size() < 2) {
+            throw SyntaxError("Wrong count of args_ in 'do'");
+        }
+        bindings_ = ParseBindings(args_[0], "do", true);
+        auto clause = Elements(args_[1], "do");
+        if (clause.empty()) {
+            throw SyntaxError("Missing test in 'do'");
+        }
+        test_ = clause[0];
+        results_.assign(clause.begin() + 1, clause.end());
+        commands_ = args_.subspan(2);
+        for (auto el : args_) {
+            FindAssigned(el, assigned_);
+        }
+    }
+
+    Object* Eval(Scope* scope) const override;
+    void MarkAll(std::unordered_set<Object*>& need) const override {
+        need.insert(std::remove_const_t<Object*>(this));
+        for (auto el : args_) {
+            if (el) {
+                el->MarkAll(need);
+            }
+        }
+    }
+    void Save(ImageWriter* writer) const override {
+        writer->WriteForm(this, "do", args_);
+    }
+
+private:
+    std::span<Object*> args_;
+    std::vector<Binding> bindings_;
+    Object* test_;
+    std::vector<Object*> results_;
+    std::span<Object*> commands_;
+    std::unordered_set<std::string> assigned_;
+    friend class DefineMemoized;
 };
 
 class SetPairElem : public Function {
 public:
-    template <class It>
-    SetPairElem(const std::string& s, It begin, It end)
-        : is_first_(s == "set-car!"), args_(begin, end) {
+    SetPairElem(const std::string& s, std::span<Object*> args)
+        : is_first_(s == "set-car!"), args_(args) {
     }
 
     Object* Eval(Scope* scope) const override {
         if (args_.size() != 2) {
-            throw SyntaxError("Wrong count of args_ in 'set-pair-elem' func");
+            return Fail(scope, ErrorKind::SYNTAX, "Wrong count of args_ in 'set-pair-elem' func");
         }
         auto elem = static_cast<Cell*>(args_[0]->Eval(scope));
+        if (dynamic_cast<LiteralCell*>(elem)) {
+            return Fail(scope, ErrorKind::RUNTIME, "Literal list cannot be modified");
+        }
+        if (scope->Collector()->Shares(elem)) {
+            return Fail(scope, ErrorKind::RUNTIME, "Shared list cannot be modified");
+        }
         auto value = args_[1]->Eval(scope);
+        scope->Collector()->NoteStore();
         if (is_first_) {
             elem->first_ = value;
         } else {
             elem->second_ = value;
+            scope->Collector()->NewSpineEpoch();
         }
         return nullptr;
     }
@@ -745,8 +1421,254 @@ public:
             }
         }
     }
+    void Save(ImageWriter* writer) const override {
+        writer->WriteForm(this, is_first_ ? "set-car!" : "set-cdr!", args_);
+    }
 
 private:
     bool is_first_;
-    std::vector<Object*> args_;
+    std::span<Object*> args_;
+};
+
+class SpawnFunc : public Function {
+public:
+    SpawnFunc(std::span<Object*> args) : args_(args) {
+    }
+
+    Object* Eval(Scope* scope) const override {
+        if (args_.size() != 1) {
+            return Fail(scope, ErrorKind::RUNTIME, "Wrong count of args_ in 'spawn'");
+        }
+        auto lambda = dynamic_cast<LambdaFunc*>(args_[0]->Eval(scope));
+        if (!lambda) {
+            return Fail(scope, ErrorKind::RUNTIME, "Unexpected argument in 'spawn'");
+        }
+        auto root = scope->Root();
+        scope->Collector()->NoteStore();
+        scope->Collector()->Tasks()->Spawn([lambda, root] {
+            std::vector<Object*> no_args;
+            lambda->FindVal(root, no_args.begin(), no_args.end());
+        });
+        return nullptr;
+    }
+    void MarkAll(std::unordered_set<Object*>& need) const override {
+        need.insert(std::remove_const_t<Object*>(this));
+        for (auto el : args_) {
+            if (el) {
+                el->MarkAll(need);
+            }
+        }
+    }
+    void Save(ImageWriter* writer) const override {
+        writer->WriteForm(this, "spawn", args_);
+    }
+
+private:
+    std::span<Object*> args_;
+};
+
+class YieldFunc : public Function {
+public:
+    YieldFunc(std::span<Object*> args) : args_(args) {
+    }
+
+    Object* Eval(Scope* scope) const override {
+        if (!args_.empty()) {
+            return Fail(scope, ErrorKind::RUNTIME, "Wrong count of args_ in 'yield'");
+        }
+        scope->Collector()->Tasks()->Yield();
+        return nullptr;
+    }
+    void MarkAll(std::unordered_set<Object*>& need) const override {
+        need.insert(std::remove_const_t<Object*>(this));
+    }
+    void Save(ImageWriter* writer) const override {
+        writer->WriteForm(this, "yield", args_);
+    }
+
+private:
+    std::span<Object*> args_;
+};
+
+class MakeChannel : public Function {
+public:
+    MakeChannel(std::span<Object*> args) : args_(args) {
+    }
+
+    Object* Eval(Scope* scope) const override {
+        if (args_.size() > 1) {
+            return Fail(scope, ErrorKind::RUNTIME, "Wrong count of args_ in 'make-channel'");
+        }
+        int64_t capacity = 1;
+        if (!args_.empty()) {
+            std::vector<Object*> eval_args;
+            if (!CheckAllNumbers(args_, scope, eval_args)) {
+                return Fail(scope, ErrorKind::RUNTIME, "Unexpected argument in 'make-channel'");
+            }
+            capacity = static_cast<Number*>(eval_args[0])->GetValue();
+        }
+        if (capacity < 1) {
+            return Fail(scope, ErrorKind::RUNTIME, "Channel capacity should be positive");
+        }
+        return scope->ResMemory(new Channel(capacity));
+    }
+    void MarkAll(std::unordered_set<Object*>& need) const override {
+        need.insert(std::remove_const_t<Object*>(this));
+        for (auto el : args_) {
+            if (el) {
+                el->MarkAll(need);
+            }
+        }
+    }
+    void Save(ImageWriter* writer) const override {
+        writer->WriteForm(this, "make-channel", args_);
+    }
+
+private:
+    std::span<Object*> args_;
+};
+
+class ChannelOperation : public Function {
+public:
+    ChannelOperation(const std::string& s, std::span<Object*> args)
+        : is_send_(s == "channel-send"), args_(args) {
+    }
+
+    Object* Eval(Scope* scope) const override {
+        if (args_.size() != (is_send_ ? 2 : 1)) {
+            return Fail(scope, ErrorKind::RUNTIME, "Wrong count of args_ in channel function");
+        }
+        auto channel = dynamic_cast<Channel*>(args_[0]->Eval(scope));
+        if (!channel) {
+            return Fail(scope, ErrorKind::RUNTIME, "Unexpected argument in channel function");
+        }
+        if (scope->Collector()->Shares(channel)) {
+            return Fail(scope, ErrorKind::RUNTIME, "Shared channel cannot be used");
+        }
+        auto scheduler = scope->Collector()->Tasks();
+        if (!is_send_) {
+            return channel->Receive(scheduler);
+        }
+        Object* value = args_[1];
+        if (auto eval = CanEval(args_[1], scope)) {
+            value = eval;
+        }
+        scope->Collector()->NoteStore();
+        channel->Send(scheduler, value);
+        return nullptr;
+    }
+    void MarkAll(std::unordered_set<Object*>& need) const override {
+        need.insert(std::remove_const_t<Object*>(this));
+        for (auto el : args_) {
+            if (el) {
+                el->MarkAll(need);
+            }
+        }
+    }
+    void Save(ImageWriter* writer) const override {
+        writer->WriteForm(this, is_send_ ? "channel-send" : "channel-receive", args_);
+    }
+
+private:
+    bool is_send_;
+    std::span<Object*> args_;
+};
+
+class MakeHashTable : public Function {
+public:
+    MakeHashTable(std::span<Object*> args) : args_(args) {
+    }
+
+    Object* Eval(Scope* scope) const override {
+        if (!args_.empty()) {
+            return Fail(scope, ErrorKind::RUNTIME, "Wrong count of args_ in 'make-hash-table'");
+        }
+        return scope->ResMemory(new HashTable());
+    }
+    void MarkAll(std::unordered_set<Object*>& need) const override {
+        need.insert(std::remove_const_t<Object*>(this));
+    }
+    void Save(ImageWriter* writer) const override {
+        writer->WriteForm(this, "make-hash-table", args_);
+    }
+
+private:
+    std::span<Object*> args_;
+};
+
+class HashTableOperation : public Function {
+public:
+    HashTableOperation(const std::string& s, std::span<Object*> args) : name_(s), args_(args) {
+    }
+
+    bool IsMutating() const {
+        return name_ == "hash-set!" || name_ == "hash-remove!";
+    }
+
+    Object* Eval(Scope* scope) const override {
+        if (name_ == "hash-count" ? args_.size() != 1
+            : name_ == "hash-set!" ? args_.size() != 3
+            : name_ == "hash-ref"  ? args_.size() != 2 && args_.size() != 3
+                                   : args_.size() != 2) {
+            return Fail(scope, ErrorKind::RUNTIME, "Wrong count of args_ in '" + name_ + "'");
+        }
+        auto table = dynamic_cast<HashTable*>(args_[0]->Eval(scope));
+        if (!table) {
+            return Fail(scope, ErrorKind::RUNTIME, "Unexpected argument in '" + name_ + "'");
+        }
+        if (IsMutating() && scope->Collector()->Shares(table)) {
+            return Fail(scope, ErrorKind::RUNTIME, "Shared hash table cannot be modified");
+        }
+        if (name_ == "hash-count") {
+            return scope->ResMemory(new Number(table->Count()));
+        }
+        auto key = EvalArg(args_[1], scope);
+        if (scope->Collector()->Failed()) {
+            return nullptr;
+        }
+        if (name_ == "hash-set!") {
+            auto value = EvalArg(args_[2], scope);
+            if (scope->Collector()->Failed()) {
+                return nullptr;
+            }
+            scope->Collector()->NoteStore();
+            table->Insert(key, value);
+            return nullptr;
+        } else if (name_ == "hash-remove!") {
+            return GetBoolConstant(table->Remove(key));
+        }
+        bool found;
+        auto value = table->Find(key, &found);
+        if (found) {
+            return value;
+        } else if (args_.size() == 3) {
+            return EvalArg(args_[2], scope);
+        }
+        return Fail(scope, ErrorKind::RUNTIME,
+                    "No such key in hash table: " + (key ? key->Print(true) : "()"));
+    }
+    void MarkAll(std::unordered_set<Object*>& need) const override {
+        need.insert(std::remove_const_t<Object*>(this));
+        for (auto el : args_) {
+            if (el) {
+                el->MarkAll(need);
+            }
+        }
+    }
+    void Save(ImageWriter* writer) const override {
+        writer->WriteForm(this, name_, args_);
+    }
+
+private:
+    // Unlike CanEval keeps an empty list as a key instead of the quote around it.
+    static Object* EvalArg(Object* arg, Scope* scope) {
+        if (dynamic_cast<Holder*>(arg) || dynamic_cast<Function*>(arg) ||
+            dynamic_cast<Symbol*>(arg) || dynamic_cast<Quote*>(arg)) {
+            return arg->Eval(scope);
+        }
+        return arg;
+    }
+
+    std::string name_;
+    std::span<Object*> args_;
 };
@@ -0,0 +1,254 @@
+#include "hash_table.h"
+
+#include "function.h"
+
+namespace {
+
+const size_t kNoSlot = SIZE_MAX;
+// Long lists are hashed by their prefix, so hashing costs the same for every key.
+const size_t kHashedElements = 64;
+
+size_t Mix(size_t seed, size_t value) {
+    return seed ^ (value + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2));
+}
+
+// Sequential integers would otherwise fill one run of slots and make probes long.
+size_t Scramble(uint64_t value) {
+    value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+    return value ^ (value >> 31);
+}
+
+const Object* Unquote(const Object* obj) {
+    while (auto quote = dynamic_cast<const Quote*>(obj)) {
+        obj = quote->Eval(nullptr);
+    }
+    return obj;
+}
+
+// A quoted list of symbols is kept as a Holder, so it is compared as the list it prints.
+bool GetElements(const Object* obj, std::vector<const Object*>* elements, const Object** tail) {
+    if (auto holder = dynamic_cast<const Holder*>(obj)) {
+        for (size_t i = 0; i != holder->Size(); ++i) {
+            elements->push_back((*holder)[i]);
+        }
+        *tail = nullptr;
+        return true;
+    }
+    auto cp = dynamic_cast<const Cell*>(obj);
+    if (!cp) {
+        return false;
+    }
+    while (cp) {
+        elements->push_back(cp->GetFirst());
+        auto next = dynamic_cast<const Cell*>(Unquote(cp->GetSecond()));
+        if (!next) {
+            *tail = cp->GetSecond();
+        }
+        cp = next;
+    }
+    return true;
+}
+
+}  // namespace
+
+size_t HashValue(const Object* obj) {
+    obj = Unquote(obj);
+    if (!obj) {
+        return 0;
+    } else if (auto np = dynamic_cast<const Number*>(obj)) {
+        return Scramble(np->GetValue());
+    } else if (auto sp = dynamic_cast<const Symbol*>(obj)) {
+        return std::hash<std::string>()(sp->GetName());
+    } else if (auto bp = dynamic_cast<const Boolean*>(obj)) {
+        return bp->GetValue() ? 1 : 2;
+    } else if (auto str = dynamic_cast<const String*>(obj)) {
+        size_t res = 4;
+        str->GetText().ForEachPiece([&res](std::string_view piece) {
+            for (unsigned char ch : piece) {
+                res = (res ^ ch) * 0x100000001b3ULL;
+            }
+        });
+        return res;
+    } else if (auto holder = dynamic_cast<const Holder*>(obj)) {
+        size_t res = 3;
+        for (size_t i = 0; i != holder->Size() && i != kHashedElements; ++i) {
+            res = Mix(res, HashValue((*holder)[i]));
+        }
+        return holder->Size() > kHashedElements ? res : Mix(res, HashValue(nullptr));
+    } else if (auto cp = dynamic_cast<const Cell*>(obj)) {
+        size_t res = 3;
+        for (size_t i = 0; cp && i != kHashedElements; ++i) {
+            res = Mix(res, HashValue(cp->GetFirst()));
+            auto next = dynamic_cast<const Cell*>(Unquote(cp->GetSecond()));
+            if (!next) {
+                res = Mix(res, HashValue(cp->GetSecond()));
+            }
+            cp = next;
+        }
+        return res;
+    }
+    return std::hash<const Object*>()(obj);
+}
+
+bool IsEqual(const Object* first, const Object* second) {
+    first = Unquote(first);
+    second = Unquote(second);
+    if (first == second) {
+        return true;
+    } else if (!first || !second) {
+        return false;
+    } else if (auto np = dynamic_cast<const Number*>(first)) {
+        auto other = dynamic_cast<const Number*>(second);
+        return other && np->GetValue() == other->GetValue();
+    } else if (auto sp = dynamic_cast<const Symbol*>(first)) {
+        auto other = dynamic_cast<const Symbol*>(second);
+        return other && sp->GetName() == other->GetName();
+    } else if (auto bp = dynamic_cast<const Boolean*>(first)) {
+        auto other = dynamic_cast<const Boolean*>(second);
+        return other && bp->GetValue() == other->GetValue();
+    } else if (auto str = dynamic_cast<const String*>(first)) {
+        auto other = dynamic_cast<const String*>(second);
+        return other && str->GetText() == other->GetText();
+    }
+    std::vector<const Object*> first_elements, second_elements;
+    const Object* first_tail;
+    const Object* second_tail;
+    if (!GetElements(first, &first_elements, &first_tail) ||
+        !GetElements(second, &second_elements, &second_tail) ||
+        first_elements.size() != second_elements.size()) {
+        return false;
+    }
+    for (size_t i = 0; i != first_elements.size(); ++i) {
+        if (!IsEqual(first_elements[i], second_elements[i])) {
+            return false;
+        }
+    }
+    return IsEqual(first_tail, second_tail);
+}
+
+size_t HashTable::Lookup(const Object* key, size_t hash) const {
+    if (slots_.empty()) {
+        return kNoSlot;
+    }
+    size_t mask = slots_.size() - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        const auto& slot = slots_[i];
+        if (slot.state == SlotState::EMPTY) {
+            return kNoSlot;
+        }
+        if (slot.state == SlotState::FULL && slot.hash == hash && IsEqual(slot.key, key)) {
+            return i;
+        }
+    }
+}
+
+Object* HashTable::Find(Object* key, bool* found) const {
+    auto index = Lookup(key, HashValue(key));
+    *found = index != kNoSlot;
+    return *found ? slots_[index].value : nullptr;
+}
+
+void HashTable::Insert(Object* key, Object* value) {
+    size_t hash = HashValue(key);
+    if (auto index = Lookup(key, hash); index != kNoSlot) {
+        slots_[index].value = value;
+        return;
+    }
+    if ((used_ + 1) * 4 > slots_.size() * 3) {
+        Grow();
+    }
+    size_t mask = slots_.size() - 1;
+    size_t i = hash & mask;
+    while (slots_[i].state == SlotState::FULL) {
+        i = (i + 1) & mask;
+    }
+    if (slots_[i].state == SlotState::EMPTY) {
+        ++used_;
+    }
+    slots_[i] = Slot{key, value, hash, SlotState::FULL};
+    ++count_;
+}
+
+bool HashTable::Remove(Object* key) {
+    auto index = Lookup(key, HashValue(key));
+    if (index == kNoSlot) {
+        return false;
+    }
+    slots_[index] = Slot{nullptr, nullptr, 0, SlotState::DELETED};
+    --count_;
+    return true;
+}
+
+void HashTable::Grow() {
+    // Tombstones are dropped on rehash, so the table grows only when it is really full.
+    size_t capacity = slots_.empty() ? 8 : slots_.size();
+    while (count_ * 2 >= capacity) {
+        capacity *= 2;
+    }
+    std::vector<Slot> old(capacity);
+    std::swap(old, slots_);
+    used_ = count_;
+    size_t mask = slots_.size() - 1;
+    for (const auto& slot : old) {
+        if (slot.state == SlotState::FULL) {
+            size_t i = slot.hash & mask;
+            while (slots_[i].state == SlotState::FULL) {
+                i = (i + 1) & mask;
+            }
+            slots_[i] = slot;
+        }
+    }
+}
+
+size_t MemoCache::ArgsHash::operator()(const std::vector<Object*>& args) const {
+    size_t res = args.size();
+    for (auto el : args) {
+        res = Mix(res, HashValue(el));
+    }
+    return res;
+}
+
+bool MemoCache::ArgsEqual::operator()(const std::vector<Object*>& first,
+                                      const std::vector<Object*>& second) const {
+    if (first.size() != second.size()) {
+        return false;
+    }
+    for (size_t i = 0; i != first.size(); ++i) {
+        if (!IsEqual(first[i], second[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+Object* MemoCache::Find(const std::vector<Object*>& args, bool* found) {
+    auto it = index_.find(args);
+    *found = it != index_.end();
+    if (!*found) {
+        ++misses_;
+        return nullptr;
+    }
+    ++hits_;
+    entries_.splice(entries_.begin(), entries_, it->second);
+    return it->second->second;
+}
+
+Object* MemoCache::Peek(const std::vector<Object*>& args, bool* found) const {
+    auto it = index_.find(args);
+    *found = it != index_.end();
+    return *found ? it->second->second : nullptr;
+}
+
+void MemoCache::Insert(const std::vector<Object*>& args, Object* result) {
+    if (auto it = index_.find(args); it != index_.end()) {
+        it->second->second = result;
+        return;
+    }
+    if (entries_.size() == capacity_) {
+        index_.erase(entries_.back().first);
+        entries_.pop_back();
+    }
+    entries_.emplace_front(args, result);
+    index_.emplace(args, entries_.begin());
+}
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+#include "object.h"
+
+// Numbers, booleans, symbols and strings are compared by value, lists by structure and every other
+// object by identity. Quotes are transparent.
+size_t HashValue(const Object*);
+bool IsEqual(const Object*, const Object*);
+
+// Open addressing with linear probing, the capacity is always a power of two.
+class HashTable : public Object {
+public:
+    Object* Find(Object* key, bool* found) const;
+    void Insert(Object* key, Object* value);
+    bool Remove(Object* key);
+    size_t Count() const {
+        return count_;
+    }
+
+    std::string Print(bool) const override {
+        return "#<hash-table>";
+    }
+    Object* Eval(Scope*) const override {
+        return std::remove_const_t<HashTable*>(this);
+    }
+    void MarkAll(std::unordered_set<Object*>& need) const override {
+        if (need.contains(std::remove_const_t<HashTable*>(this))) {
+            return;
+        }
+        need.insert(std::remove_const_t<HashTable*>(this));
+        for (const auto& slot : slots_) {
+            if (slot.state == SlotState::FULL) {
+                if (slot.key) {
+                    slot.key->MarkAll(need);
+                }
+                if (slot.value) {
+                    slot.value->MarkAll(need);
+                }
+            }
+        }
+    }
+    void CollectRefs(std::vector<Object*>& refs) const override {
+        for (const auto& slot : slots_) {
+            if (slot.state == SlotState::FULL) {
+                for (auto el : {slot.key, slot.value}) {
+                    if (el) {
+                        refs.push_back(el);
+                    }
+                }
+            }
+        }
+    }
+    void Save(ImageWriter* writer) const override {
+        std::vector<Object*> entries;
+        for (const auto& slot : slots_) {
+            if (slot.state == SlotState::FULL) {
+                entries.push_back(slot.key);
+                entries.push_back(slot.value);
+            }
+        }
+        writer->WriteHashTable(this, entries);
+    }
+
+private:
+    enum class SlotState : uint8_t { EMPTY, FULL, DELETED };
+
+    struct Slot {
+        Object* key = nullptr;
+        Object* value = nullptr;
+        size_t hash = 0;
+        SlotState state = SlotState::EMPTY;
+    };
+
+    size_t Lookup(const Object* key, size_t hash) const;
+    void Grow();
+
+    std::vector<Slot> slots_;
+    size_t count_ = 0;
+    size_t used_ = 0;
+};
+
+// Results of a pure function by the values of its arguments. The least recently used result
+// is dropped when the cache is full.
+class MemoCache {
+public:
+    explicit MemoCache(size_t capacity) : capacity_(capacity) {
+    }
+
+    Object* Find(const std::vector<Object*>& args, bool* found);
+    // Like Find, but neither counted nor moved to the front, for a cache shared with forks.
+    Object* Peek(const std::vector<Object*>& args, bool* found) const;
+    void Insert(const std::vector<Object*>& args, Object* result);
+
+    size_t Capacity() const {
+        return capacity_;
+    }
+    size_t Hits() const {
+        return hits_;
+    }
+    size_t Misses() const {
+        return misses_;
+    }
+
+    void MarkAll(std::unordered_set<Object*>& need) const {
+        for (const auto& [args, result] : entries_) {
+            for (auto el : args) {
+                if (el) {
+                    el->MarkAll(need);
+                }
+            }
+            if (result) {
+                result->MarkAll(need);
+            }
+        }
+    }
+
+private:
+    struct ArgsHash {
+        size_t operator()(const std::vector<Object*>& args) const;
+    };
+    struct ArgsEqual {
+        bool operator()(const std::vector<Object*>& first,
+                        const std::vector<Object*>& second) const;
+    };
+    using Entries = std::list<std::pair<std::vector<Object*>, Object*>>;
+
+    size_t capacity_;
+    size_t hits_ = 0;
+    size_t misses_ = 0;
+    Entries entries_;
+    std::unordered_map<std::vector<Object*>, Entries::iterator, ArgsHash, ArgsEqual> index_;
+};
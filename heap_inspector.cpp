@@ -0,0 +1,139 @@
+#include "heap_inspector.h"
+
+#include <cxxabi.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <deque>
+#include <map>
+#include <memory>
+#include <typeinfo>
+#include <unordered_map>
+
+#include "function.h"
+
+namespace {
+
+std::unordered_set<Object*> LiveObjects(const Scope* root) {
+    std::unordered_set<Object*> need;
+    root->ForEachBinding([&need](const std::string&, Object* obj) {
+        if (obj) {
+            obj->MarkAll(need);
+        }
+    });
+    return need;
+}
+
+size_t CountBindings(const Scope* scope) {
+    size_t res = 0;
+    scope->ForEachBinding([&res](const std::string&, Object*) { ++res; });
+    return res;
+}
+
+}  // namespace
+
+std::string HeapInspector::TypeName(const Object* obj) {
+    if (!obj) {
+        return "()";
+    }
+    auto name = typeid(*obj).name();
+    int status = 0;
+    std::unique_ptr<char, void (*)(void*)> demangled(
+        abi::__cxa_demangle(name, nullptr, nullptr, &status), std::free);
+    return status == 0 ? demangled.get() : name;
+}
+
+HeapReport HeapInspector::Report() const {
+    auto live = LiveObjects(root_);
+    HeapReport res;
+    res.scopes.reachable = 1;
+    res.scopes.reachable_bindings = CountBindings(root_);
+    std::map<std::string, TypeStats> types;
+    collector_->ForEachObject([&](Object* obj, size_t bytes) {
+        bool is_live = live.contains(obj);
+        auto& stats = types[TypeName(obj)];
+        ++stats.objects;
+        stats.bytes += bytes;
+        ++res.objects;
+        res.bytes += bytes;
+        if (is_live) {
+            ++stats.live_objects;
+            stats.live_bytes += bytes;
+            ++res.live_objects;
+            res.live_bytes += bytes;
+        }
+        auto lambda = dynamic_cast<LambdaFunc*>(obj);
+        if (auto closure = lambda ? lambda->Closure() : nullptr) {
+            ++(is_live ? res.scopes.reachable : res.scopes.unreachable);
+            (is_live ? res.scopes.reachable_bindings : res.scopes.unreachable_bindings) +=
+                CountBindings(closure);
+        }
+    });
+    for (auto& [name, stats] : types) {
+        stats.type = name;
+        res.types.push_back(std::move(stats));
+    }
+    std::stable_sort(res.types.begin(), res.types.end(),
+                     [](const TypeStats& a, const TypeStats& b) {
+                         return a.live_bytes > b.live_bytes;
+                     });
+    return res;
+}
+
+std::vector<RetentionStep> HeapInspector::RetentionPath(const Object* target) const {
+    if (!target) {
+        return {};
+    }
+    // Breadth-first search, every object remembers the step which reached it first.
+    struct Reached {
+        const Object* previous;
+        std::string binding;
+    };
+    std::unordered_map<const Object*, Reached> reached;
+    std::deque<Object*> queue;
+    auto visit = [&](const Object* previous, const std::string& binding, Object* obj) {
+        if (obj && !reached.contains(obj)) {
+            reached.emplace(obj, Reached{previous, binding});
+            queue.push_back(obj);
+        }
+    };
+    root_->ForEachBinding([&](const std::string& name, Object* obj) { visit(nullptr, name, obj); });
+    std::vector<Object*> refs;
+    while (!queue.empty() && !reached.contains(target)) {
+        auto obj = queue.front();
+        queue.pop_front();
+        auto lambda = dynamic_cast<LambdaFunc*>(obj);
+        if (auto closure = lambda ? lambda->Closure() : nullptr) {
+            closure->ForEachBinding(
+                [&](const std::string& name, Object* value) { visit(obj, name, value); });
+        }
+        refs.clear();
+        obj->CollectRefs(refs);
+        for (auto ref : refs) {
+            visit(obj, "", ref);
+        }
+    }
+    if (!reached.contains(target)) {
+        return {};
+    }
+    std::vector<RetentionStep> res;
+    for (auto cur = target; cur; cur = reached.at(cur).previous) {
+        res.push_back({reached.at(cur).binding, const_cast<Object*>(cur)});
+    }
+    std::reverse(res.begin(), res.end());
+    return res;
+}
+
+std::string HeapInspector::Describe(const std::vector<RetentionStep>& path) {
+    std::string res;
+    for (const auto& step : path) {
+        if (!res.empty()) {
+            res += " > ";
+        }
+        if (!step.binding.empty()) {
+            res += step.binding + ": ";
+        }
+        res += TypeName(step.object);
+    }
+    return res;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "memory_control.h"
+
+struct TypeStats {
+    std::string type;
+    size_t objects = 0;
+    size_t bytes = 0;
+    size_t live_objects = 0;
+    size_t live_bytes = 0;
+};
+
+// Frames of calls are not kept, so the scopes which outlive an evaluation are the root scope
+// and the captured variables of closures. A scope is reachable when its closure is.
+struct ScopeStats {
+    size_t reachable = 0;
+    size_t reachable_bindings = 0;
+    size_t unreachable = 0;
+    size_t unreachable_bindings = 0;
+};
+
+// Live objects are those the next collection keeps, the others are garbage not collected yet.
+struct HeapReport {
+    // Largest live size first.
+    std::vector<TypeStats> types;
+    ScopeStats scopes;
+    size_t objects = 0;
+    size_t bytes = 0;
+    size_t live_objects = 0;
+    size_t live_bytes = 0;
+};
+
+// A step of a retention path goes through a variable when binding is set, that is a binding of
+// the root scope for the first step and a captured variable of the previous closure for the
+// others. Otherwise the previous object refers to object, see Object::CollectRefs.
+struct RetentionStep {
+    std::string binding;
+    Object* object;
+};
+
+// Read-only view of a heap, valid until the heap changes.
+class HeapInspector {
+public:
+    HeapInspector(const GarbageCollector* collector, const Scope* root)
+        : collector_(collector), root_(root) {
+    }
+
+    HeapReport Report() const;
+    // Shortest path from the root scope to target, empty when target is not reachable.
+    std::vector<RetentionStep> RetentionPath(const Object* target) const;
+    // Like "f: LambdaFunc > acc: Cell > Number".
+    static std::string Describe(const std::vector<RetentionStep>& path);
+    static std::string TypeName(const Object* obj);
+
+private:
+    const GarbageCollector* collector_;
+    const Scope* root_;
+};
@@ -0,0 +1,512 @@
+#include "image.h"
+
+#include <cstring>
+#include <fstream>
+
+#include "mapped_file.h"
+#include "object.h"
+#include "function.h"
+#include "hash_table.h"
+#include "parser.h"
+
+namespace {
+
+const char kMagic[8] = {'S', 'C', 'M', 'I', 'M', 'G', '2', '\0'};
+const uint32_t kNull = UINT32_MAX;
+
+enum class RecordKind : uint8_t { NUMBER, BOOLEAN, SYMBOL, QUOTE, HOLDER, FORM, CALL, LAMBDA,
+                                  HASH_TABLE, STRING };
+
+template <class T>
+void Put(std::string* out, T value) {
+    out->append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+void PutString(std::string* out, const std::string& s) {
+    Put<uint32_t>(out, s.size());
+    out->append(s);
+}
+
+}  // namespace
+
+uint32_t ImageWriter::Ref(Object* obj) {
+    if (!obj) {
+        return kNull;
+    }
+    if (!index_.contains(obj)) {
+        obj->Save(this);
+    }
+    return index_[obj];
+}
+
+uint32_t ImageWriter::Finish(const Object* obj) {
+    return index_[obj] = cells_count_ + records_count_++;
+}
+
+void ImageWriter::WriteNumber(const Object* obj, int64_t value) {
+    Put(&records_, RecordKind::NUMBER);
+    Put(&records_, value);
+    Finish(obj);
+}
+
+void ImageWriter::WriteBoolean(const Object* obj, bool value) {
+    Put(&records_, RecordKind::BOOLEAN);
+    Put<uint8_t>(&records_, value);
+    Finish(obj);
+}
+
+void ImageWriter::WriteSymbol(const Object* obj, const std::string& name) {
+    Put(&records_, RecordKind::SYMBOL);
+    PutString(&records_, name);
+    Finish(obj);
+}
+
+void ImageWriter::WriteString(const Object* obj, const std::string& text) {
+    Put(&records_, RecordKind::STRING);
+    PutString(&records_, text);
+    Finish(obj);
+}
+
+void ImageWriter::WriteQuote(const Object* obj, Object* ptr) {
+    uint32_t ref = Ref(ptr);
+    Put(&records_, RecordKind::QUOTE);
+    Put(&records_, ref);
+    Finish(obj);
+}
+
+void ImageWriter::WriteCell(const Object* obj, Object* first, Object* second) {
+    uint32_t first_ref = Ref(first);
+    uint32_t second_ref = Ref(second);
+    Put(&cells_, index_[obj]);
+    Put(&cells_, first_ref);
+    Put(&cells_, second_ref);
+}
+
+void ImageWriter::WriteHolder(const Object* obj, std::span<Object* const> data) {
+    std::vector<uint32_t> refs;
+    for (auto el : data) {
+        refs.push_back(Ref(el));
+    }
+    Put(&records_, RecordKind::HOLDER);
+    Put<uint32_t>(&records_, refs.size());
+    for (auto ref : refs) {
+        Put(&records_, ref);
+    }
+    Finish(obj);
+}
+
+void ImageWriter::WriteForm(const Object* obj, const std::string& command,
+                            std::span<Object* const> args) {
+    std::vector<uint32_t> refs;
+    for (auto el : args) {
+        refs.push_back(Ref(el));
+    }
+    Put(&records_, RecordKind::FORM);
+    PutString(&records_, command);
+    Put<uint32_t>(&records_, refs.size());
+    for (auto ref : refs) {
+        Put(&records_, ref);
+    }
+    Finish(obj);
+}
+
+void ImageWriter::WriteCall(const Object* obj, Object* func, std::span<Object* const> args) {
+    std::vector<uint32_t> refs = {Ref(func)};
+    for (auto el : args) {
+        refs.push_back(Ref(el));
+    }
+    Put(&records_, RecordKind::CALL);
+    Put<uint32_t>(&records_, refs.size());
+    for (auto ref : refs) {
+        Put(&records_, ref);
+    }
+    Finish(obj);
+}
+
+void ImageWriter::WriteLambda(const Object* obj, const std::vector<Object*>& data, Scope* scope,
+                              size_t memo_capacity) {
+    std::vector<uint32_t> refs;
+    for (auto el : data) {
+        refs.push_back(Ref(el));
+    }
+    Put(&records_, RecordKind::LAMBDA);
+    Put<uint32_t>(&records_, refs.size());
+    for (auto ref : refs) {
+        Put(&records_, ref);
+    }
+    Put<uint64_t>(&records_, memo_capacity);
+    Finish(obj);
+    if (scope) {
+        pending_closures_.emplace_back(obj, scope);
+    }
+}
+
+void ImageWriter::WriteHashTable(const Object* obj, const std::vector<Object*>& entries) {
+    Put(&records_, RecordKind::HASH_TABLE);
+    Finish(obj);
+    pending_tables_.emplace_back(obj, entries);
+}
+
+void ImageWriter::WriteBox(const Object* obj, Object* value) {
+    auto ref = Ref(value);
+    index_[obj] = ref;
+}
+
+void ImageWriter::WriteBindings(std::string* out, Scope* scope) {
+    std::vector<std::pair<std::string, uint32_t>> bindings;
+    for (auto& [name, obj] : scope->objects_) {
+        bindings.emplace_back(name, Ref(obj));
+    }
+    Put<uint32_t>(out, bindings.size());
+    for (auto& [name, ref] : bindings) {
+        PutString(out, name);
+        Put(out, ref);
+    }
+}
+
+std::string ImageWriter::Build() {
+    std::unordered_set<Object*> reachable;
+    root_->FindAllObjects(reachable);
+    std::vector<Cell*> cells;
+    for (auto obj : reachable) {
+        if (auto cp = dynamic_cast<Cell*>(obj)) {
+            index_[cp] = cells_count_++;
+            cells.push_back(cp);
+        }
+    }
+
+    std::string roots;
+    WriteBindings(&roots, root_);
+    for (auto cell : cells) {
+        cell->Save(this);
+    }
+    while (!pending_closures_.empty() || !pending_tables_.empty()) {
+        if (!pending_closures_.empty()) {
+            auto [closure, scope] = pending_closures_.back();
+            pending_closures_.pop_back();
+            std::string bindings;
+            WriteBindings(&bindings, scope);
+            Put(&closures_, index_[closure]);
+            closures_ += bindings;
+            ++closures_count_;
+            continue;
+        }
+        auto [table, entries] = std::move(pending_tables_.back());
+        pending_tables_.pop_back();
+        std::vector<uint32_t> refs;
+        for (auto el : entries) {
+            refs.push_back(Ref(el));
+        }
+        Put(&tables_, index_[table]);
+        Put<uint32_t>(&tables_, refs.size());
+        for (auto ref : refs) {
+            Put(&tables_, ref);
+        }
+        ++tables_count_;
+    }
+
+    std::string image(kMagic, sizeof(kMagic));
+    Put(&image, cells_count_);
+    Put(&image, records_count_);
+    image += records_;
+    image += cells_;
+    Put(&image, closures_count_);
+    image += closures_;
+    Put(&image, tables_count_);
+    image += tables_;
+    image += roots;
+    return image;
+}
+
+// Records are decoded first and objects are built on demand, children before their parents.
+// A node of code may inspect the lists it receives, as let does with its bindings, so every
+// cell reachable from a child is filled before the node is made. Cells are made up front and
+// filled later, which lets lists refer to themselves.
+class ImageReader {
+public:
+    ImageReader(const char* data, size_t size, Scope* root, GarbageCollector* collector)
+        : cur_(data), end_(data + size), root_(root), collector_(collector) {
+    }
+
+    void Load() {
+        if (end_ - cur_ < static_cast<ptrdiff_t>(sizeof(kMagic)) ||
+            std::memcmp(cur_, kMagic, sizeof(kMagic))) {
+            throw RuntimeError("Wrong format of image");
+        }
+        cur_ += sizeof(kMagic);
+        cells_count_ = Get<uint32_t>();
+        auto records_count = Get<uint32_t>();
+        for (uint32_t i = 0; i != cells_count_; ++i) {
+            objects_.push_back(collector_->AddObj(new Cell(nullptr, nullptr)));
+        }
+        for (uint32_t i = 0; i != records_count; ++i) {
+            records_.push_back(ReadRecord());
+        }
+        objects_.resize(cells_count_ + records_count, nullptr);
+        states_.resize(objects_.size(), State::NEW);
+        cell_refs_.resize(cells_count_);
+        for (uint32_t i = 0; i != cells_count_; ++i) {
+            auto ref = Get<uint32_t>();
+            if (ref >= cells_count_) {
+                throw RuntimeError("Wrong format of image");
+            }
+            cell_refs_[ref] = {Get<uint32_t>(), Get<uint32_t>()};
+        }
+        for (uint32_t i = 0; i != objects_.size(); ++i) {
+            Build(i);
+        }
+        auto closures_count = Get<uint32_t>();
+        for (uint32_t i = 0; i != closures_count; ++i) {
+            auto lambda = dynamic_cast<LambdaFunc*>(GetRef());
+            if (!lambda) {
+                throw RuntimeError("Wrong format of image");
+            }
+            lambda->scope_ = std::make_unique<Scope>(root_, collector_);
+            ReadBindings(lambda->scope_.get());
+        }
+        // Keys are hashed only now, when every list they may contain is complete.
+        auto tables_count = Get<uint32_t>();
+        for (uint32_t i = 0; i != tables_count; ++i) {
+            auto table = dynamic_cast<HashTable*>(GetRef());
+            auto entries = GetRefs();
+            if (!table || entries.size() % 2) {
+                throw RuntimeError("Wrong format of image");
+            }
+            for (size_t j = 0; j != entries.size(); j += 2) {
+                table->Insert(entries[j], entries[j + 1]);
+            }
+        }
+        ReadBindings(root_);
+    }
+
+private:
+    struct Record {
+        RecordKind kind;
+        int64_t number = 0;
+        std::string text;
+        std::vector<uint32_t> refs;
+    };
+    enum class State : uint8_t { NEW, BUILDING, DONE };
+
+    template <class T>
+    T Get() {
+        if (end_ - cur_ < static_cast<ptrdiff_t>(sizeof(T))) {
+            throw RuntimeError("Image is truncated");
+        }
+        T value;
+        std::memcpy(&value, cur_, sizeof(T));
+        cur_ += sizeof(T);
+        return value;
+    }
+
+    std::string GetString() {
+        auto size = Get<uint32_t>();
+        if (static_cast<size_t>(end_ - cur_) < size) {
+            throw RuntimeError("Image is truncated");
+        }
+        std::string res(cur_, size);
+        cur_ += size;
+        return res;
+    }
+
+    std::vector<uint32_t> GetRawRefs() {
+        std::vector<uint32_t> res(Get<uint32_t>());
+        for (auto& el : res) {
+            el = Get<uint32_t>();
+        }
+        return res;
+    }
+
+    // Only for objects which are built already.
+    Object* GetRef() {
+        auto ref = Get<uint32_t>();
+        if (ref == kNull) {
+            return nullptr;
+        }
+        if (ref >= objects_.size()) {
+            throw RuntimeError("Wrong format of image");
+        }
+        return objects_[ref];
+    }
+
+    std::vector<Object*> GetRefs() {
+        std::vector<Object*> res(Get<uint32_t>());
+        for (auto& el : res) {
+            el = GetRef();
+        }
+        return res;
+    }
+
+    Record ReadRecord() {
+        Record res{};
+        res.kind = Get<RecordKind>();
+        if (res.kind == RecordKind::NUMBER) {
+            res.number = Get<int64_t>();
+        } else if (res.kind == RecordKind::BOOLEAN) {
+            res.number = Get<uint8_t>();
+        } else if (res.kind == RecordKind::SYMBOL || res.kind == RecordKind::STRING) {
+            res.text = GetString();
+        } else if (res.kind == RecordKind::QUOTE) {
+            res.refs.push_back(Get<uint32_t>());
+        } else if (res.kind == RecordKind::HOLDER || res.kind == RecordKind::CALL) {
+            res.refs = GetRawRefs();
+        } else if (res.kind == RecordKind::FORM) {
+            res.text = GetString();
+            res.refs = GetRawRefs();
+        } else if (res.kind == RecordKind::LAMBDA) {
+            res.refs = GetRawRefs();
+            res.number = Get<uint64_t>();
+        } else if (res.kind != RecordKind::HASH_TABLE) {
+            throw RuntimeError("Wrong format of image");
+        }
+        return res;
+    }
+
+    // A cell is complete when its whole list structure is filled.
+    Object* Build(uint32_t ref) {
+        if (ref == kNull) {
+            return nullptr;
+        }
+        if (ref >= objects_.size()) {
+            throw RuntimeError("Wrong format of image");
+        }
+        if (ref < cells_count_) {
+            FillCells(ref);
+            return objects_[ref];
+        }
+        if (states_[ref] == State::BUILDING) {
+            throw RuntimeError("Wrong format of image");
+        }
+        if (states_[ref] == State::NEW) {
+            states_[ref] = State::BUILDING;
+            objects_[ref] = MakeObject(records_[ref - cells_count_]);
+            states_[ref] = State::DONE;
+        }
+        return objects_[ref];
+    }
+
+    // Without recursion along the lists, which may be long.
+    void FillCells(uint32_t ref) {
+        std::vector<uint32_t> pending = {ref};
+        while (!pending.empty()) {
+            auto cur = pending.back();
+            pending.pop_back();
+            if (states_[cur] != State::NEW) {
+                continue;
+            }
+            states_[cur] = State::DONE;
+            auto cell = static_cast<Cell*>(objects_[cur]);
+            for (auto child : {cell_refs_[cur].first, cell_refs_[cur].second}) {
+                if (child != kNull && child < cells_count_) {
+                    pending.push_back(child);
+                }
+            }
+            cell->first_ = Build(cell_refs_[cur].first);
+            cell->second_ = Build(cell_refs_[cur].second);
+            cell->ForgetSpine();
+        }
+    }
+
+    std::vector<Object*> BuildAll(const std::vector<uint32_t>& refs) {
+        std::vector<Object*> res;
+        for (auto ref : refs) {
+            res.push_back(Build(ref));
+        }
+        return res;
+    }
+
+    Object* MakeObject(const Record& record) {
+        auto kind = record.kind;
+        if (kind == RecordKind::NUMBER) {
+            return collector_->AddObj(new Number(record.number));
+        } else if (kind == RecordKind::BOOLEAN) {
+            return collector_->AddObj(EvalBoolValue(record.number));
+        } else if (kind == RecordKind::SYMBOL) {
+            return collector_->AddObj(new Symbol(record.text));
+        } else if (kind == RecordKind::QUOTE) {
+            return collector_->AddObj(new Quote(Build(record.refs[0])));
+        } else if (kind == RecordKind::HOLDER) {
+            auto data = BuildAll(record.refs);
+            return collector_->AddNode<Holder>(data.begin(), data.end());
+        } else if (kind == RecordKind::FORM) {
+            std::vector<Object*> form = {collector_->AddObj(new Symbol(record.text))};
+            for (auto el : BuildAll(record.refs)) {
+                form.push_back(el);
+            }
+            return GetIfFunction(form, collector_);
+        } else if (kind == RecordKind::CALL) {
+            auto call = BuildAll(record.refs);
+            if (call.empty()) {
+                throw RuntimeError("Wrong format of image");
+            }
+            if (auto res = GetIfFunction(call, collector_)) {
+                return res;
+            }
+            throw RuntimeError("Wrong format of image");
+        } else if (kind == RecordKind::LAMBDA) {
+            auto data = BuildAll(record.refs);
+            if (data.empty()) {
+                throw RuntimeError("Wrong format of image");
+            }
+            auto lambda = new LambdaFunc(data.begin(), data.end());
+            collector_->AddObj(lambda);
+            if (record.number) {
+                lambda->memo_ = std::make_unique<MemoCache>(record.number);
+            }
+            return lambda;
+        } else if (kind == RecordKind::HASH_TABLE) {
+            return collector_->AddObj(new HashTable());
+        }
+        return collector_->AddObj(new String(Rope(record.text)));
+    }
+
+    void ReadBindings(Scope* scope) {
+        auto count = Get<uint32_t>();
+        for (uint32_t i = 0; i != count; ++i) {
+            auto name = GetString();
+            scope->Set(name, GetRef());
+        }
+    }
+
+    const char* cur_;
+    const char* end_;
+    Scope* root_;
+    GarbageCollector* collector_;
+    uint32_t cells_count_ = 0;
+    std::vector<Record> records_;
+    std::vector<std::pair<uint32_t, uint32_t>> cell_refs_;
+    std::vector<Object*> objects_;
+    std::vector<State> states_;
+};
+
+void SaveImage(const std::string& path, Scope* root) {
+    auto image = ImageWriter(root).Build();
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out || !out.write(image.data(), image.size())) {
+        throw RuntimeError("Cannot write image " + path);
+    }
+}
+
+void LoadImage(const std::string& path, Scope* root, GarbageCollector* collector) {
+    MappedFile file(path);
+    ImageReader(file.Data(), file.Size(), root, collector).Load();
+}
+
+// Forms are bound to their positions in a scope of their own.
+std::string SaveForms(std::span<Object* const> forms, GarbageCollector* collector) {
+    Scope scope(nullptr, collector);
+    for (size_t i = 0; i != forms.size(); ++i) {
+        scope.Set(std::to_string(i), forms[i]);
+    }
+    return ImageWriter(&scope).Build();
+}
+
+std::vector<Object*> LoadForms(std::string_view image, GarbageCollector* collector) {
+    Scope scope(nullptr, collector);
+    ImageReader(image.data(), image.size(), &scope, collector).Load();
+    std::vector<Object*> res;
+    while (auto form = scope.Find(std::to_string(res.size()))) {
+        res.push_back(*form);
+    }
+    return res;
+}
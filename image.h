@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "memory_control.h"
+
+// Every object reachable from the root scope is stored as a record which refers to other
+// objects by index, so an image does not depend on the addresses it was saved from.
+class ImageWriter {
+public:
+    explicit ImageWriter(Scope* root) : root_(root) {
+    }
+
+    std::string Build();
+
+    void WriteNumber(const Object* obj, int64_t value);
+    void WriteBoolean(const Object* obj, bool value);
+    void WriteSymbol(const Object* obj, const std::string& name);
+    void WriteString(const Object* obj, const std::string& text);
+    void WriteQuote(const Object* obj, Object* ptr);
+    void WriteCell(const Object* obj, Object* first, Object* second);
+    void WriteHolder(const Object* obj, std::span<Object* const> data);
+    void WriteForm(const Object* obj, const std::string& command, std::span<Object* const> args);
+    void WriteCall(const Object* obj, Object* func, std::span<Object* const> args);
+    // A memo capacity of zero means the function is not memoized, cached results are not saved.
+    void WriteLambda(const Object* obj, const std::vector<Object*>& data, Scope* scope,
+                     size_t memo_capacity);
+    // Entries are written after every record, so a table may contain itself.
+    void WriteHashTable(const Object* obj, const std::vector<Object*>& entries);
+    // A box is saved as its value, so closures loaded from the image no longer share it.
+    void WriteBox(const Object* obj, Object* value);
+
+private:
+    uint32_t Ref(Object* obj);
+    uint32_t Finish(const Object* obj);
+    void WriteBindings(std::string* out, Scope* scope);
+
+    Scope* root_;
+    std::unordered_map<const Object*, uint32_t> index_;
+    uint32_t records_count_ = 0;
+    uint32_t cells_count_ = 0;
+    std::vector<std::pair<const Object*, Scope*>> pending_closures_;
+    std::string records_;
+    std::string cells_;
+    std::string closures_;
+    uint32_t closures_count_ = 0;
+    std::vector<std::pair<const Object*, std::vector<Object*>>> pending_tables_;
+    std::string tables_;
+    uint32_t tables_count_ = 0;
+};
+
+void SaveImage(const std::string& path, Scope* root);
+void LoadImage(const std::string& path, Scope* root, GarbageCollector* collector);
+// Image of a sequence of objects, such as the parsed forms of a file, in the same format.
+std::string SaveForms(std::span<Object* const> forms, GarbageCollector* collector);
+std::vector<Object*> LoadForms(std::string_view image, GarbageCollector* collector);
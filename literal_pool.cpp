@@ -0,0 +1,76 @@
+#include "literal_pool.h"
+
+#include "function.h"
+
+bool LiteralPool::IsPooled(Object* obj) const {
+    return !obj || pooled_.contains(obj) || obj == GetBoolConstant(true) ||
+           obj == GetBoolConstant(false);
+}
+
+Object* LiteralPool::Add(Object* obj) {
+    objects_.emplace_back(obj);
+    pooled_.insert(obj);
+    return obj;
+}
+
+Object* LiteralPool::GetNumber(int64_t value) {
+    std::lock_guard lock(mutex_);
+    if (auto it = numbers_.find(value); it != numbers_.end()) {
+        return it->second;
+    }
+    if (IsFull()) {
+        return nullptr;
+    }
+    return numbers_[value] = Add(new Number(value));
+}
+
+Object* LiteralPool::GetString(const std::string& text) {
+    std::lock_guard lock(mutex_);
+    if (auto it = strings_.find(text); it != strings_.end()) {
+        return it->second;
+    }
+    if (IsFull()) {
+        return nullptr;
+    }
+    return strings_[text] = Add(new String(Rope(text)));
+}
+
+Object* LiteralPool::GetSymbol(const std::string& name) {
+    std::lock_guard lock(mutex_);
+    if (auto it = symbols_.find(name); it != symbols_.end()) {
+        return it->second;
+    }
+    if (IsFull()) {
+        return nullptr;
+    }
+    return symbols_[name] = Add(new Symbol(name));
+}
+
+Object* LiteralPool::GetQuote(Object* datum) {
+    std::lock_guard lock(mutex_);
+    if (!IsPooled(datum)) {
+        return nullptr;
+    }
+    if (auto it = quotes_.find(datum); it != quotes_.end()) {
+        return it->second;
+    }
+    if (IsFull()) {
+        return nullptr;
+    }
+    return quotes_[datum] = Add(new Quote(datum));
+}
+
+Object* LiteralPool::GetCell(Object* first, Object* second) {
+    std::lock_guard lock(mutex_);
+    if (!policy_.share_lists || !IsPooled(first) || !IsPooled(second)) {
+        return nullptr;
+    }
+    auto key = std::make_pair(first, second);
+    if (auto it = cells_.find(key); it != cells_.end()) {
+        return it->second;
+    }
+    if (IsFull()) {
+        return nullptr;
+    }
+    return cells_[key] = Add(new LiteralCell(first, second));
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "object.h"
+
+// A capacity of zero turns the pool off. Pooled lists are constants, set-car! and set-cdr!
+// fail on them, so quoted lists are shared only with share_lists set.
+struct LiteralPolicy {
+    size_t capacity = 1 << 16;
+    bool share_lists = false;
+};
+
+// Immutable literals of the source, each distinct value is stored once. The pool lives outside
+// the collected heap as long as the interpreter, the reader takes literals from it until it
+// is full and allocates them in the collector after that. Readers on several threads may
+// share a pool.
+class LiteralPool {
+public:
+    explicit LiteralPool(const LiteralPolicy& policy = LiteralPolicy()) : policy_(policy) {
+    }
+    LiteralPool(const LiteralPool&) = delete;
+    LiteralPool& operator=(const LiteralPool&) = delete;
+
+    void SetPolicy(const LiteralPolicy& policy) {
+        std::lock_guard lock(mutex_);
+        policy_ = policy;
+    }
+    LiteralPolicy Policy() const {
+        std::lock_guard lock(mutex_);
+        return policy_;
+    }
+
+    // Each method returns nullptr when the literal cannot be pooled.
+    Object* GetNumber(int64_t value);
+    Object* GetString(const std::string& text);
+    // Symbols are pooled only inside quotes, closures find their free variables by identity.
+    Object* GetSymbol(const std::string& name);
+    Object* GetQuote(Object* datum);
+    // Both parts must be pooled already.
+    Object* GetCell(Object* first, Object* second);
+
+    size_t Size() const {
+        std::lock_guard lock(mutex_);
+        return objects_.size();
+    }
+
+private:
+    struct PairHash {
+        size_t operator()(const std::pair<Object*, Object*>& key) const {
+            return std::hash<Object*>()(key.first) * 31 + std::hash<Object*>()(key.second);
+        }
+    };
+
+    bool IsPooled(Object* obj) const;
+    bool IsFull() const {
+        return objects_.size() >= policy_.capacity;
+    }
+    Object* Add(Object* obj);
+
+    mutable std::mutex mutex_;
+    LiteralPolicy policy_;
+    std::vector<std::unique_ptr<Object>> objects_;
+    std::unordered_set<const Object*> pooled_;
+    std::unordered_map<int64_t, Object*> numbers_;
+    std::unordered_map<std::string, Object*> strings_;
+    std::unordered_map<std::string, Object*> symbols_;
+    std::unordered_map<Object*, Object*> quotes_;
+    std::unordered_map<std::pair<Object*, Object*>, Object*, PairHash> cells_;
+};
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "error.h"
+
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd == -1) {
+            throw RuntimeError("Cannot open file " + path);
+        }
+        struct stat info;
+        if (fstat(fd, &info) == -1) {
+            close(fd);
+            throw RuntimeError("Cannot stat file " + path);
+        }
+        size_ = info.st_size;
+        mtime_ = info.st_mtim.tv_sec * 1'000'000'000 + info.st_mtim.tv_nsec;
+        if (size_) {
+            void* data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED) {
+                close(fd);
+                throw RuntimeError("Cannot map file " + path);
+            }
+            data_ = static_cast<const char*>(data);
+        }
+        close(fd);
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() {
+        if (data_) {
+            munmap(const_cast<char*>(data_), size_);
+        }
+    }
+
+    const char* Data() const {
+        return data_;
+    }
+    size_t Size() const {
+        return size_;
+    }
+    // In nanoseconds, a file rewritten within a second is still told apart.
+    int64_t ModificationTime() const {
+        return mtime_;
+    }
+
+private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+    int64_t mtime_ = 0;
+};
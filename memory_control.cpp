@@ -1,53 +1,189 @@
+#include <algorithm>
+
 #include "memory_control.h"
+#include "fiber.h"
+#include "image.h"
 #include "object.h"
+#include "parallel_mark.h"
 
-void GarbageCollector::FindAllObjects(std::unordered_set<Object*>& need) {
-    std::unordered_set<Scope*> useful_scopes;
-    for (auto& scope : scopes_) {
-        scope->MarkUseful(useful_scopes);
-    }
-    std::vector<std::unique_ptr<Scope>> cleaned_scopes;
-    for (auto& scope : scopes_) {
-        if (useful_scopes.contains(&*scope)) {
-            cleaned_scopes.push_back(std::move(scope));
-        }
-    }
-    scopes_.clear();
-    for (auto& scope : cleaned_scopes) {
-        scopes_.push_back(std::move(scope));
+void GarbageCollector::UpdateThreshold() {
+    threshold_ = std::max(policy_.trigger_bytes,
+                          static_cast<size_t>(static_cast<double>(heap_bytes_) * policy_.growth_factor));
+    if (policy_.heap_limit) {
+        threshold_ = std::min(threshold_, policy_.heap_limit);
     }
+}
 
-    for (auto& scope : scopes_) {
-        scope->FindAllObjects(need);
-    }
+template <class IsMarked>
+void GarbageCollector::SweepUnmarked(const IsMarked& is_marked) {
     std::vector<std::unique_ptr<Object>> new_ptr;
-    for (auto& ptr : obj_) {
-        if (need.contains(&*ptr)) {
-            new_ptr.push_back(std::move(ptr));
+    std::vector<size_t> new_sizes;
+    heap_bytes_ = 0;
+    for (size_t i = 0; i != obj_.size(); ++i) {
+        if (is_marked(&*obj_[i])) {
+            new_ptr.push_back(std::move(obj_[i]));
+            new_sizes.push_back(sizes_[i]);
+            heap_bytes_ += sizes_[i];
         }
     }
     obj_.clear();
     for (auto& el : new_ptr) {
         obj_.push_back(std::move(el));
     }
+    sizes_ = std::move(new_sizes);
+    UpdateThreshold();
+    ++collections_;
 }
 
-void Scope::MarkUseful(std::unordered_set<Scope*>& useful_scopes) {
-    bool is_useful = objects_.empty();
-    for (auto& [_, el] : objects_) {
-        if (!dynamic_cast<Number*>(el)) {
-            is_useful = true;
-            break;
+void GarbageCollector::FindAllObjects(std::unordered_set<Object*>& need) {
+    SweepUnmarked([&need](Object* obj) { return need.contains(obj); });
+}
+
+void GarbageCollector::FindAllObjects(const MarkSet& marked) {
+    SweepUnmarked([&marked](Object* obj) { return marked.Contains(obj); });
+}
+
+void GarbageCollector::Freeze() {
+    if (!forks_++) {
+        shared_.reserve(obj_.size());
+        for (const auto& obj : obj_) {
+            shared_.insert(obj.get());
         }
     }
-    if (is_useful) {
-        auto cur = this;
-        while (cur) {
-            if (useful_scopes.contains(cur)) {
-                break;
+}
+
+void GarbageCollector::Thaw() {
+    if (!--forks_) {
+        shared_.clear();
+    }
+}
+
+// Lengths stamped with epoch or an earlier one are not current any more afterwards. When the
+// epochs run out the lengths cached in this heap and the heaps it was forked from are forgotten
+// and the epochs start again.
+void GarbageCollector::PassSpineEpoch(uint64_t epoch) {
+    auto cur = SpineEpoch();
+    while (cur <= epoch) {
+        if (epoch >= Cell::kMaxEpoch) {
+            for (auto heap = this; heap; heap = heap->base_) {
+                heap->ForEachObject([](Object* obj, size_t) {
+                    if (auto cell = dynamic_cast<Cell*>(obj)) {
+                        cell->ForgetSpine();
+                    }
+                });
             }
-            useful_scopes.insert(cur);
-            cur = cur->parent_;
+            spine_epoch_.store(1, std::memory_order_relaxed);
+            return;
+        }
+        if (spine_epoch_.compare_exchange_weak(cur, epoch + 1, std::memory_order_relaxed)) {
+            return;
         }
     }
 }
+
+void Object::CollectRefs(std::vector<Object*>& refs) const {
+    std::unordered_set<Object*> reached;
+    MarkAll(reached);
+    reached.erase(std::remove_const_t<Object*>(this));
+    refs.insert(refs.end(), reached.begin(), reached.end());
+}
+
+void Box::Save(ImageWriter* writer) const {
+    writer->WriteBox(this, value_);
+}
+
+Object* GarbageCollector::Fail(ErrorKind kind, const std::string& message) {
+    if (!keep_errors_) {
+        RaiseError({kind, message});
+    }
+    if (!error_) {
+        error_ = EvalError{kind, message};
+    }
+    return nullptr;
+}
+
+void GarbageCollector::RaiseError(const EvalError& error) {
+    switch (error.kind) {
+        case ErrorKind::SYNTAX:
+            throw SyntaxError(error.message);
+        case ErrorKind::NAME:
+            throw NameError(error.message);
+        default:
+            throw RuntimeError(error.message);
+    }
+}
+
+void GarbageCollector::Pin() {
+    ++pins_;
+    // The evaluation refers to objects of a loop region too, so the region must end.
+    ++stores_;
+    pin_first_ = obj_.size();
+    pin_switches_ = Fiber::Switches();
+}
+
+void GarbageCollector::CollectPinned(std::unordered_set<Object*>& need) {
+    if (Fiber::Switches() != pin_switches_) {
+        pin_first_ = obj_.size();
+        pin_switches_ = Fiber::Switches();
+    }
+    for (size_t i = 0; i != pin_first_; ++i) {
+        obj_[i]->MarkAll(need);
+    }
+    SweepSince(pin_first_, need);
+    UpdateThreshold();
+    ++collections_;
+}
+
+void GarbageCollector::SweepSince(size_t first, const std::unordered_set<Object*>& need) {
+    size_t kept = first;
+    for (size_t i = first; i != obj_.size(); ++i) {
+        if (need.contains(&*obj_[i])) {
+            obj_[kept] = std::move(obj_[i]);
+            sizes_[kept] = sizes_[i];
+            ++kept;
+        } else {
+            heap_bytes_ -= sizes_[i];
+            obj_[i].reset();
+        }
+    }
+    obj_.resize(kept);
+    sizes_.resize(kept);
+}
+
+namespace {
+
+// Marking starts only when the region holds more objects than this, and than twice the number
+// marked last time, so marking costs a constant per allocation.
+const size_t kRegionBudget = 4096;
+
+}  // namespace
+
+LoopRegion::LoopRegion(GarbageCollector* collector)
+    : collector_(collector), outer_mark_(collector->region_mark_), budget_(kRegionBudget) {
+    Reset();
+}
+
+LoopRegion::~LoopRegion() {
+    collector_->region_mark_ = outer_mark_;
+}
+
+void LoopRegion::Reset() {
+    first_ = collector_->obj_.size();
+    collector_->region_mark_ = collector_->allocations_;
+    stores_ = collector_->stores_;
+    switches_ = Fiber::Switches();
+}
+
+void LoopRegion::EndIteration(Scope* frame) {
+    if (collector_->stores_ != stores_ || Fiber::Switches() != switches_) {
+        Reset();
+        return;
+    }
+    if (collector_->obj_.size() - first_ < budget_) {
+        return;
+    }
+    std::unordered_set<Object*> need;
+    frame->FindAllObjects(need);
+    collector_->SweepSince(first_, need);
+    budget_ = std::max(kRegionBudget, 2 * need.size());
+}
@@ -1,14 +1,40 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <memory>
 #include <cstdint>
 #include <iostream>
+#include <new>
+#include <optional>
+#include <span>
+#include <typeinfo>
 #include <unordered_map>
 #include <unordered_set>
+#include <utility>
 #include <vector>
 #include "error.h"
+#include "eval_result.h"
 
 class Scope;
+class ImageWriter;
+class Scheduler;
+class LiteralPool;
+class MarkSet;
+
+struct OutOfMemoryError : public RuntimeError {
+    using RuntimeError::RuntimeError;
+};
+
+// Sizes are shallow sizes of the objects, a limit of zero means no limit and a limit must not
+// be below trigger_bytes. With mark_threads other than one a collection marks on several
+// threads, zero means one per core.
+struct GcPolicy {
+    size_t trigger_bytes = 1 << 20;
+    double growth_factor = 2.0;
+    size_t heap_limit = 0;
+    size_t mark_threads = 1;
+};
 
 class Object {
 public:
@@ -16,39 +42,413 @@ public:
     virtual Object* Eval(Scope*) const = 0;
     virtual std::string Print(bool) const = 0;
     virtual void MarkAll(std::unordered_set<Object*>&) const = 0;
+    virtual void Save(ImageWriter*) const = 0;
+    // Expressions compute a value when evaluated, other objects evaluate to themselves or to
+    // a copy. A virtual call is much cheaper than probing the type with dynamic_cast.
+    virtual bool IsExpression() const {
+        return false;
+    }
+    // Objects this one refers to, for HeapInspector. By default everything MarkAll reaches is
+    // reported, containers of data override it with their direct references.
+    virtual void CollectRefs(std::vector<Object*>& refs) const;
+    // Nodes made by GarbageCollector::AddNode are larger than their type, so the size must not
+    // be passed to the global operator delete.
+    static void operator delete(void* ptr) {
+        ::operator delete(ptr);
+    }
+};
+
+// Checked at safepoints of a running evaluation, may suspend or stop it.
+class EvalBudget {
+public:
+    virtual ~EvalBudget() = default;
+    virtual void Tick() = 0;
 };
 
 class GarbageCollector {
 public:
-    Object* AddObj(Object* ptr) {
+    template <class T>
+    Object* AddObj(T* ptr, size_t bytes = sizeof(T)) {
         obj_.emplace_back(ptr);
+        ++allocations_;
+        sizes_.push_back(bytes);
+        heap_bytes_ += bytes;
+        if (policy_.heap_limit && heap_bytes_ > policy_.heap_limit) {
+            throw OutOfMemoryError("Heap limit exceeded");
+        }
         return &*obj_.back();
     }
-    void AddScope(Scope* ptr) {
-        scopes_.emplace_back(ptr);
+    // Makes a node of the syntax tree, its operands are copied right after it in the same
+    // allocation and it receives them as a span. The node and its operands need one allocation
+    // and usually share a cache line. The arguments of the constructor precede the operands.
+    template <class T, class It, class... Args>
+    Object* AddNode(It begin, It end, Args&&... args) {
+        size_t count = end - begin;
+        size_t bytes = sizeof(T) + count * sizeof(Object*);
+        auto memory = static_cast<char*>(::operator new(bytes));
+        auto operands = reinterpret_cast<Object**>(memory + sizeof(T));
+        std::copy(begin, end, operands);
+        T* node;
+        try {
+            node = new (memory) T(std::forward<Args>(args)..., std::span<Object*>(operands, count));
+        } catch (...) {
+            ::operator delete(memory);
+            throw;
+        }
+        return AddObj(node, bytes);
+    }
+    // Takes ownership of everything allocated by other, e.g. by a parser running on another thread.
+    void Adopt(GarbageCollector* other) {
+        for (size_t i = 0; i != other->obj_.size(); ++i) {
+            obj_.push_back(std::move(other->obj_[i]));
+            sizes_.push_back(other->sizes_[i]);
+            heap_bytes_ += other->sizes_[i];
+        }
+        allocations_ += other->obj_.size();
+        other->obj_.clear();
+        other->sizes_.clear();
+        other->heap_bytes_ = 0;
+        if (policy_.heap_limit && heap_bytes_ > policy_.heap_limit) {
+            throw OutOfMemoryError("Heap limit exceeded");
+        }
+    }
+    void SetPolicy(const GcPolicy& policy) {
+        if (policy.heap_limit && policy.heap_limit < policy.trigger_bytes) {
+            throw RuntimeError("Heap limit is below the collection trigger");
+        }
+        policy_ = policy;
+        threshold_ = policy_.trigger_bytes;
+    }
+    const GcPolicy& Policy() const {
+        return policy_;
+    }
+    // Past the heap limit every allocation fails, so only a collection lets evaluation go on.
+    bool NeedCollect() const {
+        return heap_bytes_ >= threshold_ || (policy_.heap_limit && heap_bytes_ > policy_.heap_limit);
+    }
+    // While an evaluation is suspended its intermediate results are not reachable from any
+    // scope, so until it finishes only what was allocated since it last ran may be collected,
+    // see CollectPinned.
+    void Pin();
+    void Unpin() {
+        --pins_;
+    }
+    bool Pinned() const {
+        return pins_;
+    }
+    EvalBudget* SetBudget(EvalBudget* budget) {
+        return std::exchange(budget_, budget);
+    }
+    void SetScheduler(Scheduler* scheduler) {
+        scheduler_ = scheduler;
+    }
+    Scheduler* Tasks() const {
+        if (!scheduler_) {
+            throw RuntimeError("Tasks are not supported here");
+        }
+        return scheduler_;
+    }
+    // Pool which the reader takes constants from, objects of the pool are not collected.
+    void SetLiterals(LiteralPool* literals) {
+        literals_ = literals;
+    }
+    LiteralPool* Literals() const {
+        return literals_;
+    }
+    void Safepoint() {
+        CheckFailed();
+        if (budget_) {
+            budget_->Tick();
+        }
+    }
+    // While errors are kept Fail records the first error and returns nullptr, and evaluation
+    // returns early up to the caller instead of unwinding. Otherwise Fail throws the error.
+    bool KeepErrors(bool keep) {
+        return std::exchange(keep_errors_, keep);
+    }
+    Object* Fail(ErrorKind kind, const std::string& message);
+    bool Failed() const {
+        return error_.has_value();
+    }
+    std::optional<EvalError> TakeError() {
+        return std::exchange(error_, std::nullopt);
+    }
+    // Code which does not look at Failed is stopped by the kept error at its next call or
+    // store, so no effect happens after the error.
+    void CheckFailed() {
+        if (error_) [[unlikely]] {
+            RaiseError(*error_);
+        }
+    }
+    size_t HeapBytes() const {
+        return heap_bytes_;
+    }
+    size_t Objects() const {
+        return obj_.size();
+    }
+    size_t Collections() const {
+        return collections_;
+    }
+    uint64_t Allocations() const {
+        return allocations_;
+    }
+    // Records that an object which may be older than the current loop region now refers to
+    // another object. The variant with birth ignores stores into scopes made inside the region.
+    void NoteStore() {
+        CheckFailed();
+        ++stores_;
+    }
+    void NoteStore(uint64_t birth) {
+        CheckFailed();
+        if (birth < region_mark_) {
+            ++stores_;
+        }
+    }
+    // The heap of an interpreter with live forks is shared with them and does not change, see
+    // Interpreter::Fork. The first fork records which objects are shared.
+    void ForkFrom(GarbageCollector* base) {
+        base->Freeze();
+        base_ = base;
+        spine_epoch_.store(base->SpineEpoch(), std::memory_order_relaxed);
+    }
+    bool Frozen() const {
+        return forks_.load(std::memory_order_relaxed);
+    }
+    // Whether obj belongs to the heap of an interpreter this one was forked from.
+    bool Shares(const Object* obj) const {
+        for (auto cur = base_; cur; cur = cur->base_) {
+            if (cur->shared_.contains(obj)) {
+                return true;
+            }
+        }
+        return false;
     }
     void FindAllObjects(std::unordered_set<Object*>& need);
+    void FindAllObjects(const MarkSet& marked);
+    // Collection while evaluations are pinned, need holds what the roots reach. A suspended
+    // evaluation cannot refer to objects allocated after the last Pin and the last switch of
+    // fibers, older objects are kept and marked from. Must not be called from a fiber.
+    void CollectPinned(std::unordered_set<Object*>& need);
+    // Calls f(object, bytes) for every object of the heap, in allocation order.
+    template <class F>
+    void ForEachObject(F&& f) const {
+        for (size_t i = 0; i != obj_.size(); ++i) {
+            f(obj_[i].get(), sizes_[i]);
+        }
+    }
+
+    // Lengths of lists cached in the cells are current in the epoch they were stamped with,
+    // see Cell. Each heap counts its own epochs, so set-cdr! in one interpreter leaves the
+    // lengths cached by the others alone.
+    uint64_t SpineEpoch() const {
+        return spine_epoch_.load(std::memory_order_relaxed);
+    }
+    // Called after the rest of a cell of this heap changed.
+    void NewSpineEpoch() {
+        PassSpineEpoch(SpineEpoch());
+    }
+
+    GarbageCollector() = default;
+    GarbageCollector(const GarbageCollector&) = delete;
+    GarbageCollector& operator=(const GarbageCollector&) = delete;
+    ~GarbageCollector() {
+        if (base_) {
+            // A fork starts in the epoch of its base and stamps the shared cells as well, the
+            // base goes on past every epoch the fork was in.
+            if (auto epoch = SpineEpoch(); epoch != base_->SpineEpoch()) {
+                base_->PassSpineEpoch(epoch);
+            }
+            base_->Thaw();
+        }
+    }
 
 private:
+    [[noreturn]] static void RaiseError(const EvalError& error);
+    void Freeze();
+    void Thaw();
+    template <class IsMarked>
+    void SweepUnmarked(const IsMarked& is_marked);
+    void SweepSince(size_t first, const std::unordered_set<Object*>& need);
+    // The heap size of the next collection, after one which left heap_bytes_.
+    void UpdateThreshold();
+    void PassSpineEpoch(uint64_t epoch);
+
     std::vector<std::unique_ptr<Object>> obj_;
-    std::vector<std::unique_ptr<Scope>> scopes_;
-    friend class LambdaFunc;
+    std::vector<size_t> sizes_;
+    GcPolicy policy_;
+    size_t heap_bytes_ = 0;
+    size_t threshold_ = GcPolicy().trigger_bytes;
+    size_t collections_ = 0;
+    size_t pins_ = 0;
+    // Objects before pin_first_ were allocated before the last Pin or switch of fibers seen.
+    size_t pin_first_ = 0;
+    uint64_t pin_switches_ = 0;
+    EvalBudget* budget_ = nullptr;
+    Scheduler* scheduler_ = nullptr;
+    LiteralPool* literals_ = nullptr;
+    uint64_t allocations_ = 0;
+    uint64_t stores_ = 0;
+    uint64_t region_mark_ = 0;
+    bool keep_errors_ = false;
+    std::optional<EvalError> error_;
+    GarbageCollector* base_ = nullptr;
+    std::atomic<size_t> forks_{0};
+    std::unordered_set<const Object*> shared_;
+    std::atomic<uint64_t> spine_epoch_{1};
+    friend class LoopRegion;
+};
+
+// Frees objects which iterations of a loop allocated and dropped, while the loop runs.
+// Objects allocated before the region began cannot refer to newer ones unless a store was
+// noted, so the loop variables are the only roots. A store or a switch of fibers moves the
+// region past everything allocated so far.
+class LoopRegion {
+public:
+    explicit LoopRegion(GarbageCollector* collector);
+    LoopRegion(const LoopRegion&) = delete;
+    LoopRegion& operator=(const LoopRegion&) = delete;
+    ~LoopRegion();
+
+    // Called between iterations, when frame holds every value the next iteration needs.
+    void EndIteration(Scope* frame);
+
+private:
+    void Reset();
+
+    GarbageCollector* collector_;
+    uint64_t outer_mark_;
+    size_t first_ = 0;
+    uint64_t stores_ = 0;
+    uint64_t switches_ = 0;
+    size_t budget_;
+};
+
+// A variable which some code assigns with set!, moved out of its frame when a closure
+// captures it so that the frame and every closure share it. Scopes read and write the value
+// through the box, it is never the value of an expression.
+class Box : public Object {
+public:
+    explicit Box(Object* value) : value_(value) {
+    }
+    static bool Is(const Object* obj) {
+        return obj && typeid(*obj) == typeid(Box);
+    }
+    Object* Eval(Scope*) const override {
+        return value_;
+    }
+    std::string Print(bool b) const override {
+        return value_ ? value_->Print(b) : "()";
+    }
+    void MarkAll(std::unordered_set<Object*>& need) const override {
+        if (!need.insert(std::remove_const_t<Object*>(this)).second) {
+            return;
+        }
+        if (value_) {
+            value_->MarkAll(need);
+        }
+    }
+    void Save(ImageWriter* writer) const override;
+    void CollectRefs(std::vector<Object*>& refs) const override {
+        if (value_) {
+            refs.push_back(value_);
+        }
+    }
+
+private:
+    Object* value_;
+    friend class Scope;
+};
+
+// Bindings which a fork changed in the scopes it shares with the interpreters it was forked
+// from. Those scopes are frozen while the fork lives, a lookup in a frozen scope checks the
+// overlay of the fork evaluating on the thread first.
+class ForkOverlay {
+public:
+    ForkOverlay(const ForkOverlay* base, GarbageCollector* collector)
+        : base_(base), collector_(collector) {
+    }
+    ForkOverlay(const ForkOverlay&) = delete;
+    ForkOverlay& operator=(const ForkOverlay&) = delete;
+
+    // Makes overlay current on the thread while it lives.
+    class Active {
+    public:
+        explicit Active(ForkOverlay* overlay) : outer_(std::exchange(Current(), overlay)) {
+        }
+        Active(const Active&) = delete;
+        Active& operator=(const Active&) = delete;
+        ~Active() {
+            Current() = outer_;
+        }
+
+    private:
+        ForkOverlay* outer_;
+    };
+
+    static ForkOverlay*& Current() {
+        thread_local ForkOverlay* current = nullptr;
+        return current;
+    }
+
+    // Bindings are kept per scope, or per box for a variable which scopes share through a
+    // box, with an empty name. Bindings of the overlays this one is based on are found too,
+    // but must not be written.
+    Object** Find(const void* owner, const std::string& name) const {
+        for (auto cur = this; cur; cur = cur->base_) {
+            if (auto it = cur->bindings_.find(owner); it != cur->bindings_.end()) {
+                if (auto found = it->second.find(name); found != it->second.end()) {
+                    return const_cast<Object**>(&found->second);
+                }
+            }
+        }
+        return nullptr;
+    }
+    void Set(const void* owner, const std::string& name, Object* obj) {
+        collector_->NoteStore();
+        bindings_[owner][name] = obj;
+    }
+    template <class F>
+    void ForEachValue(F&& f) const {
+        for (const auto& scope : bindings_) {
+            for (const auto& [_, obj] : scope.second) {
+                f(obj);
+            }
+        }
+    }
+
+private:
+    const ForkOverlay* base_;
+    GarbageCollector* collector_;
+    std::unordered_map<const void*, std::unordered_map<std::string, Object*>> bindings_;
 };
 
 class Scope {
 public:
-    Scope(Scope* ptr, GarbageCollector* collector) : parent_(ptr) {
+    // A root scope with a parent is the global scope of a fork. It passes everything to the
+    // global scope it was forked from, which the fork changes through its overlay.
+    Scope(Scope* ptr, GarbageCollector* collector, bool is_root = false)
+        : parent_(ptr), is_root_(is_root) {
         collector_ = collector;
+        birth_ = collector->Allocations();
     }
-    Scope(Scope* other) : objects_(other->objects_), parent_(other), collector_(other->collector_) {
+    // Names which the code running in this frame may assign, a closure capturing one of them
+    // shares it with the frame through a box. The set must outlive the scope.
+    void SetAssigned(const std::unordered_set<std::string>* names) {
+        assigned_ = names;
     }
     void Set(const std::string& name, Object* obj) {
-        objects_[name] = obj;
+        Store(name, obj);
+    }
+    // Binding which a loop updates in place, it must exist. Storing into it replaces a box, so
+    // closures made by an earlier iteration keep the value of their own iteration.
+    Object** Slot(const std::string& name) {
+        return &objects_.at(name);
     }
-    void MarkUseful(std::unordered_set<Scope*>& useful_scopes);
     void FindAllObjects(std::unordered_set<Object*>& need) {
         for (auto [_, obj] : objects_) {
-            obj->MarkAll(need);
+            if (obj) {
+                obj->MarkAll(need);
+            }
         }
     }
     void SetExisted(const std::string& name, Object* obj) {
@@ -59,7 +459,7 @@ public:
             parent_->SetExisted(name, obj);
             return;
         }
-        objects_[name] = obj;
+        Store(name, obj);
     }
     void SetIfNotExist(const std::string& name, Object* obj) {
         auto cur = this;
@@ -69,35 +469,144 @@ public:
             }
             cur = cur->parent_;
         }
-        objects_[name] = obj;
+        Store(name, obj);
     }
     bool Contains(const std::string& name) const {
+        if (auto overlay = Overlay(); overlay && overlay->Find(this, name)) [[unlikely]] {
+            return true;
+        }
         return objects_.contains(name);
     }
-    Object* Get(const std::string& name) {
-        if (!objects_.contains(name)) {
-            if (!parent_) {
-                throw NameError("No such variable in scope");
+    template <class F>
+    void ForEachBinding(F&& f) const {
+        for (const auto& [name, obj] : objects_) {
+            f(name, obj);
+        }
+    }
+    // Binding of name in this scope only, or nullptr.
+    Object** Find(const std::string& name) {
+        auto slot = Binding(name);
+        if (has_boxes_ && slot && Box::Is(*slot)) [[unlikely]] {
+            auto box = static_cast<Box*>(*slot);
+            if (auto overlay = Overlay()) {
+                if (auto changed = overlay->Find(box, {})) {
+                    return changed;
+                }
             }
-            return parent_->Get(name);
+            return &box->value_;
+        }
+        return slot;
+    }
+    Object* Get(const std::string& name) {
+        if (auto slot = Find(name)) {
+            return *slot;
+        }
+        if (!parent_) {
+            throw NameError("No such variable in scope");
         }
-        return objects_[name];
+        return parent_->Get(name);
     }
-    Object* ResMemory(Object* obj) {
+    template <class T>
+    Object* ResMemory(T* obj) {
         return collector_->AddObj(obj);
     }
+    template <class T, class It, class... Args>
+    Object* ResNode(It begin, It end, Args&&... args) {
+        return collector_->AddNode<T>(begin, end, std::forward<Args>(args)...);
+    }
     Scope* Parent() const {
         return parent_;
     }
-    Scope* MakeScope() {
-        Scope* new_scope = new Scope(std::remove_const_t<Scope*>(this), collector_);
-        collector_->AddScope(new_scope);
-        return new_scope;
+    GarbageCollector* Collector() const {
+        return collector_;
+    }
+    Scope* Root() {
+        auto cur = this;
+        while (!cur->IsRoot()) {
+            cur = cur->parent_;
+        }
+        return cur;
+    }
+    // Flat environment of a closure: only the given names are taken from the enclosing
+    // (non-global) scopes, global names are still resolved through the root scope. A variable
+    // which its frame may assign is shared through a box, the others are copied.
+    std::unique_ptr<Scope> MakeClosure(const std::vector<std::string>& names) {
+        auto closure = std::make_unique<Scope>(Root(), collector_);
+        for (const auto& name : names) {
+            for (auto cur = this; !cur->IsRoot(); cur = cur->parent_) {
+                if (auto slot = cur->Binding(name)) {
+                    if (cur->assigned_ && cur->assigned_->contains(name) && !Box::Is(*slot)) {
+                        cur->collector_->NoteStore(cur->birth_);
+                        *slot = collector_->AddObj(new Box(*slot));
+                        cur->has_boxes_ = true;
+                    }
+                    closure->objects_[name] = *slot;
+                    closure->has_boxes_ |= Box::Is(*slot);
+                    break;
+                }
+            }
+        }
+        return closure;
     }
 
 private:
+    bool IsRoot() const {
+        return !parent_ || is_root_;
+    }
+    ForkOverlay* Overlay() const {
+        return collector_->Frozen() ? ForkOverlay::Current() : nullptr;
+    }
+    // Binding of name in this scope only as it is stored, possibly a box.
+    Object** Binding(const std::string& name) {
+        if (auto overlay = Overlay()) [[unlikely]] {
+            if (auto slot = overlay->Find(this, name)) {
+                return slot;
+            }
+        }
+        auto it = objects_.find(name);
+        return it == objects_.end() ? nullptr : &it->second;
+    }
+    void Store(const std::string& name, Object* obj) {
+        if (is_root_) [[unlikely]] {
+            parent_->Store(name, obj);
+            return;
+        }
+        Box* box = nullptr;
+        if (has_boxes_) [[unlikely]] {
+            if (auto it = objects_.find(name); it != objects_.end() && Box::Is(it->second)) {
+                box = static_cast<Box*>(it->second);
+            }
+        }
+        if (collector_->Frozen()) [[unlikely]] {
+            auto overlay = ForkOverlay::Current();
+            if (!overlay) {
+                throw RuntimeError("Scope is shared with a fork");
+            }
+            if (box) {
+                overlay->Set(box, {}, obj);
+            } else {
+                overlay->Set(this, name, obj);
+            }
+            return;
+        }
+        if (box) {
+            // The box may be older than the scope, e.g. when a closure assigns it.
+            collector_->NoteStore();
+            box->value_ = obj;
+            return;
+        }
+        collector_->NoteStore(birth_);
+        objects_[name] = obj;
+    }
+
     std::unordered_map<std::string, Object*> objects_;
     Scope* parent_ = nullptr;
+    bool is_root_;
+    bool has_boxes_ = false;
     GarbageCollector* collector_;
+    uint64_t birth_;
+    const std::unordered_set<std::string>* assigned_ = nullptr;
     friend class LambdaFunc;
+    friend class ImageWriter;
+    friend class ImageReader;
 };
@@ -0,0 +1,28 @@
+#include "module_cache.h"
+
+#include "image.h"
+#include "mapped_file.h"
+#include "parser.h"
+
+std::vector<Object*> ModuleCache::Read(const std::string& path, GarbageCollector* collector,
+                                       size_t threads) {
+    MappedFile file(path);
+    std::shared_ptr<const std::string> image;
+    {
+        std::lock_guard lock(mutex_);
+        auto it = entries_.find(path);
+        if (it != entries_.end() && it->second.mtime == file.ModificationTime() &&
+            it->second.size == file.Size()) {
+            image = it->second.image;
+            ++hits_;
+        }
+    }
+    if (image) {
+        return LoadForms(*image, collector);
+    }
+    auto forms = ReadForms({file.Data(), file.Size()}, collector, threads);
+    image = std::make_shared<const std::string>(SaveForms(forms, collector));
+    std::lock_guard lock(mutex_);
+    entries_[path] = {file.ModificationTime(), file.Size(), std::move(image)};
+    return forms;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "memory_control.h"
+
+// Parsed forms of the files read so far, kept as images and shared by every interpreter of
+// the process. A file is tokenized and parsed again only when its modification time or its
+// size changes, otherwise its forms are rebuilt from the image.
+class ModuleCache {
+public:
+    static ModuleCache& Shared() {
+        static ModuleCache cache;
+        return cache;
+    }
+
+    // Forms of the file at path allocated in collector, a file is read on up to threads threads.
+    std::vector<Object*> Read(const std::string& path, GarbageCollector* collector,
+                              size_t threads);
+
+    size_t Hits() const {
+        std::lock_guard lock(mutex_);
+        return hits_;
+    }
+    void Clear() {
+        std::lock_guard lock(mutex_);
+        entries_.clear();
+    }
+
+private:
+    struct Entry {
+        int64_t mtime;
+        size_t size;
+        std::shared_ptr<const std::string> image;
+    };
+
+    mutable std::mutex mutex_;
+    std::unordered_map<std::string, Entry> entries_;
+    size_t hits_ = 0;
+};
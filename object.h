@@ -1,14 +1,21 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <memory>
 #include <cstdint>
 #include <iostream>
+#include <mutex>
+#include <span>
+#include <typeinfo>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
 #include "error.h"
 #include "memory_control.h"
+#include "image.h"
+#include "rope.h"
 
 class Quote : public Object {
 public:
@@ -24,9 +31,22 @@ public:
     Object* Eval(Scope*) const override {
         return ptr_;
     }
+    bool IsExpression() const override {
+        return true;
+    }
     void MarkAll(std::unordered_set<Object*>& need) const override {
         need.insert(std::remove_const_t<Object*>(this));
-        ptr_->MarkAll(need);
+        if (ptr_) {
+            ptr_->MarkAll(need);
+        }
+    }
+    void Save(ImageWriter* writer) const override {
+        writer->WriteQuote(this, ptr_);
+    }
+    void CollectRefs(std::vector<Object*>& refs) const override {
+        if (ptr_) {
+            refs.push_back(ptr_);
+        }
     }
 
 private:
@@ -47,12 +67,15 @@ public:
     std::string Print(bool) const override {
         return std::to_string(value_);
     }
-    Object* Eval(Scope* scope) const override {
-        return scope->ResMemory(new Number(*this));
+    Object* Eval(Scope*) const override {
+        return std::remove_const_t<Object*>(this);
     }
     void MarkAll(std::unordered_set<Object*>& need) const override {
         need.insert(std::remove_const_t<Object*>(this));
     }
+    void Save(ImageWriter* writer) const override {
+        writer->WriteNumber(this, value_);
+    }
 
 private:
     int64_t value_;
@@ -60,14 +83,14 @@ private:
 
 class Boolean : public Object {
 public:
-    Boolean(const std::string& s) : val_(s) {
+    Boolean(const std::string& s) : value_(s == "#t") {
     }
     Boolean(const Boolean&) = default;
     std::string Print(bool) const override {
-        return val_;
+        return value_ ? "#t" : "#f";
     }
-    std::string GetVal() const {
-        return val_;
+    bool GetValue() const {
+        return value_;
     }
     Object* Eval(Scope*) const override {
         return std::remove_const_t<Object*>(this);
@@ -75,40 +98,148 @@ public:
     void MarkAll(std::unordered_set<Object*>& need) const override {
         need.insert(std::remove_const_t<Object*>(this));
     }
+    void Save(ImageWriter* writer) const override {
+        writer->WriteBoolean(this, value_);
+    }
+
+private:
+    bool value_;
+};
+
+// Symbols with the same name share one copy of it, which is freed with the last of them. The
+// table is split into shards, so threads making symbols at once rarely wait for each other. A
+// name given to the tracer is kept until the process exits, see TraceEvent.
+class InternedName {
+public:
+    static InternedName* Acquire(const std::string& text) {
+        auto& shard = ShardOf(text);
+        std::lock_guard lock(shard.mutex);
+        auto& name = shard.names[text];
+        if (!name) {
+            name.reset(new InternedName(text));
+        }
+        ++name->count_;
+        return name.get();
+    }
+    void Release() {
+        auto& shard = ShardOf(text_);
+        std::lock_guard lock(shard.mutex);
+        if (--count_ == 0 && !traced_.load(std::memory_order_relaxed)) {
+            // text_ dies with the entry, so it only serves to find it.
+            shard.names.erase(shard.names.find(text_));
+        }
+    }
+    const std::string& Text() const {
+        return text_;
+    }
+    const char* TraceName() {
+        traced_.store(true, std::memory_order_relaxed);
+        return text_.c_str();
+    }
 
 private:
-    std::string val_;
+    static constexpr size_t kShards = 16;
+
+    struct Shard {
+        std::mutex mutex;
+        std::unordered_map<std::string, std::unique_ptr<InternedName>> names;
+    };
+
+    explicit InternedName(const std::string& text) : text_(text) {
+    }
+    // The shards are never destroyed, symbols of static objects may be released at exit.
+    static Shard& ShardOf(const std::string& text) {
+        static auto shards = new Shard[kShards];
+        return shards[std::hash<std::string>()(text) % kShards];
+    }
+
+    const std::string text_;
+    size_t count_ = 0;
+    std::atomic<bool> traced_{false};
 };
 
 class Symbol : public Object {
 public:
-    Symbol(const std::string& s) : name_(s) {
+    Symbol(const std::string& s) : name_(InternedName::Acquire(s)) {
     }
 
-    Symbol(const Symbol&) = default;
+    Symbol(const Symbol& other) : name_(InternedName::Acquire(other.GetName())) {
+    }
+    Symbol& operator=(const Symbol&) = delete;
+    ~Symbol() {
+        name_->Release();
+    }
 
     const std::string& GetName() const {
-        return name_;
+        return name_->Text();
+    }
+    // The name kept for the tracer, which stores it without copying.
+    const char* TraceName() const {
+        return name_->TraceName();
     }
 
     std::string Print(bool) const override {
-        return name_;
+        return name_->Text();
     }
     Object* Eval(Scope* scope) const override {
-        while (!scope->Contains(name_)) {
-            if (!scope->Parent()) {
-                throw NameError("No such variable");
+        for (auto cur = scope; cur; cur = cur->Parent()) {
+            if (auto slot = cur->Find(name_->Text())) {
+                return *slot;
             }
-            scope = scope->Parent();
         }
-        return scope->Get(name_);
+        return scope->Collector()->Fail(ErrorKind::NAME, "No such variable");
+    }
+    bool IsExpression() const override {
+        return true;
     }
     void MarkAll(std::unordered_set<Object*>& need) const override {
         need.insert(std::remove_const_t<Object*>(this));
     }
+    void Save(ImageWriter* writer) const override {
+        writer->WriteSymbol(this, name_->Text());
+    }
 
 private:
-    std::string name_;
+    InternedName* name_;
+};
+
+class String : public Object {
+public:
+    String(Rope text) : text_(std::move(text)) {
+    }
+
+    const Rope& GetText() const {
+        return text_;
+    }
+
+    std::string Print(bool) const override {
+        std::string res = "\"";
+        text_.ForEachPiece([&res](std::string_view piece) {
+            for (char ch : piece) {
+                if (ch == '"' || ch == '\\') {
+                    res.push_back('\\');
+                    res.push_back(ch);
+                } else if (ch == '\n') {
+                    res += "\\n";
+                } else {
+                    res.push_back(ch);
+                }
+            }
+        });
+        return res + "\"";
+    }
+    Object* Eval(Scope*) const override {
+        return std::remove_const_t<Object*>(this);
+    }
+    void MarkAll(std::unordered_set<Object*>& need) const override {
+        need.insert(std::remove_const_t<Object*>(this));
+    }
+    void Save(ImageWriter* writer) const override {
+        writer->WriteString(this, text_.ToString());
+    }
+
+private:
+    Rope text_;
 };
 
 class Pair : public Object {
@@ -133,49 +264,46 @@ public:
     void MarkAll(std::unordered_set<Object*>&) const override {
         throw std::runtime_error("Pair cannot be used");
     }
+    void Save(ImageWriter*) const override {
+        throw std::runtime_error("Pair cannot be used");
+    }
 
 private:
     Object* first_;
     Object* second_;
 };
 
+// Every cell caches the length of the list which starts at it, a cell made in front of a cell
+// with a known length knows its own. Lengths are stamped with the epoch of the heap which reads
+// them, set-cdr! starts a new epoch of its heap, which drops the lengths cached there at once,
+// and they are found again by walking the list. Other interpreters keep theirs, see
+// GarbageCollector::NewSpineEpoch.
 class Cell : public Object {
 public:
-    Cell(Object* f, Object* s) : first_(f), second_(s) {
+    // Without a collector the length is not known until it is asked for.
+    Cell(Object* f, Object* s, const GarbageCollector* collector = nullptr)
+        : first_(f), second_(s), spine_(collector ? SpineBefore(s, collector->SpineEpoch()) : 0) {
     }
 
-    Cell(const Pair& p) : first_(p.GetFirst()), second_(p.GetSecond()) {
+    Cell(const Pair& p) : Cell(p.GetFirst(), p.GetSecond()) {
     }
 
-    Cell(const std::vector<Object*>& obj, GarbageCollector* collector)
-        : first_(nullptr), second_(nullptr) {
-        Cell* cur = nullptr;
-        for (size_t i = 0; i != obj.size(); ++i) {
-            auto new_node = static_cast<Cell*>(collector->AddObj(new Cell(obj[i], nullptr)));
-            if (cur) {
-                cur->second_ = new_node;
-                cur = new_node;
-            } else {
-                first_ = new_node->first_;
-                second_ = new_node->second_;
-                cur = this;
-            }
+    // Only the cells after the first are allocated, this one holds the first element.
+    Cell(std::span<Object* const> obj, GarbageCollector* collector)
+        : first_(obj.empty() ? nullptr : obj[0]), second_(nullptr) {
+        auto epoch = collector->SpineEpoch();
+        auto cur = this;
+        for (size_t i = 1; i < obj.size(); ++i) {
+            auto next = static_cast<Cell*>(collector->AddObj(new Cell(obj[i], nullptr)));
+            cur->second_ = next;
+            cur->spine_.store(PackSpine(epoch, obj.size() - i + 1, false),
+                              std::memory_order_relaxed);
+            cur = next;
         }
+        cur->spine_.store(PackSpine(epoch, 1, false), std::memory_order_relaxed);
     }
 
-    Cell(const std::vector<Object*>& obj, Scope* scope) : first_(nullptr), second_(nullptr) {
-        Cell* cur = nullptr;
-        for (size_t i = 0; i != obj.size(); ++i) {
-            auto new_node = static_cast<Cell*>(scope->ResMemory(new Cell(obj[i], nullptr)));
-            if (cur) {
-                cur->second_ = new_node;
-                cur = new_node;
-            } else {
-                first_ = new_node->first_;
-                second_ = new_node->second_;
-                cur = this;
-            }
-        }
+    Cell(std::span<Object* const> obj, Scope* scope) : Cell(obj, scope->Collector()) {
     }
 
     Object* GetFirst() const {
@@ -186,8 +314,8 @@ public:
         return second_;
     }
 
-    Object* GetTail(size_t ind) {
-        if (!IsList()) {
+    Object* GetTail(size_t ind, const GarbageCollector* collector) {
+        if (!IsList(collector)) {
             return GetSecond();
         }
         const Object* res = this;
@@ -214,55 +342,81 @@ public:
         return false;
     }
 
-    bool IsList() const {
-        const Object* res = this;
-        while (true) {
-            auto cp = static_cast<const Cell*>(res);
-            if (!cp->GetSecond()) {
-                return true;
-            }
-            if (cp->GetFirst() && !dynamic_cast<Cell*>(&*cp->GetSecond())) {
-                return false;
-            }
-            res = cp->GetSecond();
-        }
+    // A circular list is not a list.
+    bool IsList(const GarbageCollector* collector) const {
+        return !(Spine(collector->SpineEpoch()) & kImproperBit);
+    }
+
+    // Number of cells up to the end of the list, for a list which does not end with () the
+    // cells before its end.
+    size_t Length(const GarbageCollector* collector) const {
+        return Spine(collector->SpineEpoch()) & kLengthMask;
     }
 
     Object* GetElement(size_t number) const noexcept {
-        const Object* res = this;
-        for (size_t i = 0; i < number; ++i) {
-            auto cp = dynamic_cast<const Cell*>(res);
-            if (!cp->GetSecond()) {
-                return nullptr;
-            }
-            res = cp->GetSecond();
+        auto cp = this;
+        for (size_t i = 0; cp && i < number; ++i) {
+            cp = dynamic_cast<const Cell*>(cp->second_);
         }
-        auto cp = dynamic_cast<const Cell*>(res);
-        return cp->GetFirst();
+        return cp ? cp->first_ : nullptr;
     }
 
+    // The rest of a list is followed in a loop and nested lists wait on an explicit stack, so
+    // neither a long nor a deep list recurses. Other objects, literal cells among them, mark
+    // themselves.
     void MarkAll(std::unordered_set<Object*>& need) const override {
-        if (need.contains(std::remove_const_t<Object*>(this))) {
-            return;
-        }
-        need.insert(std::remove_const_t<Object*>(this));
-        if (first_) {
-            first_->MarkAll(need);
+        std::vector<const Cell*> nested;
+        auto cur = this;
+        while (true) {
+            if (!cur || !need.insert(std::remove_const_t<Object*>(cur)).second) {
+                if (nested.empty()) {
+                    return;
+                }
+                cur = nested.back();
+                nested.pop_back();
+                continue;
+            }
+            if (IsPlainCell(cur->first_)) {
+                nested.push_back(static_cast<const Cell*>(cur->first_));
+            } else if (cur->first_) {
+                cur->first_->MarkAll(need);
+            }
+            if (IsPlainCell(cur->second_)) {
+                cur = static_cast<const Cell*>(cur->second_);
+            } else {
+                if (cur->second_) {
+                    cur->second_->MarkAll(need);
+                }
+                cur = nullptr;
+            }
         }
-        if (second_) {
-            second_->MarkAll(need);
+    }
+    void Save(ImageWriter* writer) const override {
+        writer->WriteCell(this, first_, second_);
+    }
+    void CollectRefs(std::vector<Object*>& refs) const override {
+        for (auto el : {first_, second_}) {
+            if (el) {
+                refs.push_back(el);
+            }
         }
     }
 
+    // Appends the elements in a loop, the text of a long list is built in one string.
     std::string Print(bool b) const override {
-        std::string res = (first_) ? first_->Print(true) : "()";
-        if (second_ && !dynamic_cast<Cell*>(&*second_)) {
-            res += " . " + second_->Print(false);
-        } else {
-            res += (second_ ? " " + second_->Print(false) : "");
+        std::string res = b ? "(" : "";
+        for (auto cp = this; cp;) {
+            res += cp->first_ ? cp->first_->Print(true) : "()";
+            auto next = dynamic_cast<const Cell*>(cp->second_);
+            if (next) {
+                res += ' ';
+            } else if (cp->second_) {
+                res += " . " + cp->second_->Print(false);
+            }
+            cp = next;
         }
         if (b) {
-            res = "(" + res + ")";
+            res += ')';
         }
         return res;
     }
@@ -272,9 +426,105 @@ public:
     }
 
 private:
+    // A cached length is packed with the epoch it was found in and whether the list ends with
+    // something else than () or runs in a circle. Epoch zero is never current, it marks a
+    // length not known.
+    static constexpr uint64_t kLengthMask = (uint64_t(1) << 32) - 1;
+    static constexpr uint64_t kImproperBit = uint64_t(1) << 32;
+    static constexpr int kEpochShift = 33;
+    static constexpr uint64_t kMaxEpoch = (uint64_t(1) << 31) - 1;
+
+    static bool IsPlainCell(const Object* obj) {
+        return obj && typeid(*obj) == typeid(Cell);
+    }
+    static uint64_t PackSpine(uint64_t epoch, size_t length, bool improper) {
+        if (length > kLengthMask) {
+            return 0;
+        }
+        return epoch << kEpochShift | (improper ? kImproperBit : 0) | length;
+    }
+    static bool IsCurrent(uint64_t spine, uint64_t epoch) {
+        return spine && spine >> kEpochShift == epoch;
+    }
+    static uint64_t SpineBefore(const Object* second, uint64_t epoch) {
+        if (!second) {
+            return PackSpine(epoch, 1, false);
+        }
+        auto cell = dynamic_cast<const Cell*>(second);
+        if (!cell) {
+            return PackSpine(epoch, 1, true);
+        }
+        auto spine = cell->spine_.load(std::memory_order_relaxed);
+        if (!IsCurrent(spine, epoch)) {
+            return 0;
+        }
+        return PackSpine(epoch, (spine & kLengthMask) + 1, spine & kImproperBit);
+    }
+    void ForgetSpine() {
+        spine_.store(0, std::memory_order_relaxed);
+    }
+    // Walks up to the first cell with a known length, then stores the lengths of the cells
+    // before it, so each cell is walked once per epoch. A second pointer follows at half the
+    // pace, the walk meets it again only on a circle.
+    uint64_t Spine(uint64_t epoch) const {
+        if (auto spine = spine_.load(std::memory_order_relaxed); IsCurrent(spine, epoch)) {
+            return spine;
+        }
+        size_t count = 0;
+        size_t rest = 0;
+        bool improper = false;
+        auto slow = this;
+        for (auto cp = this; cp;) {
+            if (auto spine = cp->spine_.load(std::memory_order_relaxed);
+                IsCurrent(spine, epoch)) {
+                rest = spine & kLengthMask;
+                improper = spine & kImproperBit;
+                break;
+            }
+            ++count;
+            auto next = dynamic_cast<const Cell*>(cp->second_);
+            improper = !next && cp->second_;
+            cp = next;
+            if (count % 2 == 0) {
+                slow = static_cast<const Cell*>(slow->second_);
+            }
+            if (cp == slow) {
+                improper = true;
+                break;
+            }
+        }
+        uint64_t res = PackSpine(epoch, rest + count, improper);
+        if (!res) {
+            return (improper ? kImproperBit : 0) | std::min<size_t>(rest + count, kLengthMask);
+        }
+        auto cp = this;
+        for (size_t i = 0; i != count; ++i) {
+            cp->spine_.store(PackSpine(epoch, rest + count - i, improper),
+                             std::memory_order_relaxed);
+            if (i + 1 != count) {
+                cp = static_cast<const Cell*>(cp->second_);
+            }
+        }
+        return res;
+    }
+
     Object* first_;
     Object* second_;
+    mutable std::atomic<uint64_t> spine_{0};
     friend class SetPairElem;
+    friend class GarbageCollector;
+    friend class ImageReader;
+};
+
+// Cell of a quoted list from the literal pool. Everything it refers to is pooled as well, so
+// marking stops here, and the list cannot be modified.
+class LiteralCell : public Cell {
+public:
+    using Cell::Cell;
+
+    void MarkAll(std::unordered_set<Object*>& need) const override {
+        need.insert(std::remove_const_t<Object*>(this));
+    }
 };
 
 template <class T>
@@ -0,0 +1,138 @@
+#include "parallel_mark.h"
+
+#include <algorithm>
+#include <bit>
+#include <thread>
+#include <vector>
+
+#include "trace.h"
+
+MarkSet::MarkSet(size_t expected) {
+    size_t capacity = std::bit_ceil(std::max<size_t>(2 * expected, 1024));
+    slots_.reset(new std::atomic<Object*>[capacity]);
+    for (size_t i = 0; i != capacity; ++i) {
+        slots_[i].store(nullptr, std::memory_order_relaxed);
+    }
+    mask_ = capacity - 1;
+    shift_ = 64 - std::countr_zero(capacity);
+}
+
+bool MarkSet::Insert(Object* obj) {
+    auto index = Hash(obj);
+    for (size_t probe = 0; probe != kMaxProbes; ++probe, index = (index + 1) & mask_) {
+        auto cur = slots_[index].load(std::memory_order_relaxed);
+        if (!cur && slots_[index].compare_exchange_strong(cur, obj, std::memory_order_relaxed)) {
+            return true;
+        }
+        if (cur == obj) {
+            return false;
+        }
+    }
+    // Slots are never freed, so every thread which gets here for obj saw the same full slots.
+    std::lock_guard lock(overflow_mutex_);
+    return overflow_.insert(obj).second;
+}
+
+bool MarkSet::Contains(Object* obj) const {
+    auto index = Hash(obj);
+    for (size_t probe = 0; probe != kMaxProbes; ++probe, index = (index + 1) & mask_) {
+        auto cur = slots_[index].load(std::memory_order_relaxed);
+        if (cur == obj) {
+            return true;
+        } else if (!cur) {
+            return false;
+        }
+    }
+    return overflow_.contains(obj);
+}
+
+namespace {
+
+// A private stack larger than this gives half of itself away when its shared part is empty.
+const size_t kShareAbove = 64;
+
+struct SharedStack {
+    std::mutex mutex;
+    std::vector<Object*> objects;
+    std::atomic<bool> empty{true};
+};
+
+}  // namespace
+
+std::unique_ptr<MarkSet> ParallelMark(std::span<Object* const> roots, size_t threads,
+                                      size_t expected) {
+    TraceSpan span(TraceKind::GC, "mark");
+    if (!threads) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    auto marked = std::make_unique<MarkSet>(expected);
+    std::vector<SharedStack> shared(threads);
+    // Objects found and not processed yet, marking ends when it drops to zero.
+    std::atomic<size_t> pending{0};
+    for (size_t i = 0; i != roots.size(); ++i) {
+        if (roots[i] && marked->Insert(roots[i])) {
+            ++pending;
+            shared[i % threads].objects.push_back(roots[i]);
+            shared[i % threads].empty = false;
+        }
+    }
+
+    auto take = [&](SharedStack& from, std::vector<Object*>& to, bool half) {
+        if (from.empty.load(std::memory_order_relaxed)) {
+            return;
+        }
+        std::lock_guard lock(from.mutex);
+        size_t count = half ? (from.objects.size() + 1) / 2 : from.objects.size();
+        to.insert(to.end(), from.objects.end() - count, from.objects.end());
+        from.objects.resize(from.objects.size() - count);
+        from.empty.store(from.objects.empty(), std::memory_order_relaxed);
+    };
+    auto mark = [&](size_t index) {
+        auto& own = shared[index];
+        std::vector<Object*> local;
+        std::vector<Object*> refs;
+        while (pending.load(std::memory_order_acquire)) {
+            take(own, local, false);
+            for (size_t i = 1; local.empty() && i != threads; ++i) {
+                take(shared[(index + i) % threads], local, true);
+            }
+            if (local.empty()) {
+                std::this_thread::yield();
+                continue;
+            }
+            while (!local.empty()) {
+                auto obj = local.back();
+                local.pop_back();
+                refs.clear();
+                obj->CollectRefs(refs);
+                size_t found = 0;
+                for (auto ref : refs) {
+                    if (ref && marked->Insert(ref)) {
+                        local.push_back(ref);
+                        ++found;
+                    }
+                }
+                // One update for the object done and the objects found.
+                if (found != 1) {
+                    pending.fetch_add(found - 1, std::memory_order_acq_rel);
+                }
+                if (threads > 1 && local.size() > kShareAbove &&
+                    own.empty.load(std::memory_order_relaxed)) {
+                    std::lock_guard lock(own.mutex);
+                    own.objects.assign(local.begin(), local.begin() + local.size() / 2);
+                    local.erase(local.begin(), local.begin() + local.size() / 2);
+                    own.empty.store(false, std::memory_order_relaxed);
+                }
+            }
+        }
+    };
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < threads; ++i) {
+        workers.emplace_back(mark, i);
+    }
+    mark(0);
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    return marked;
+}
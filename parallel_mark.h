@@ -0,0 +1,43 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <unordered_set>
+
+#include "memory_control.h"
+
+// Objects marked by several threads at once, an open addressing table where a thread claims a
+// slot with one compare and swap. Objects which find no free slot near their hash, when the
+// expected count was too low, go to a locked overflow set.
+class MarkSet {
+public:
+    explicit MarkSet(size_t expected);
+
+    // Returns true when obj was not marked yet.
+    bool Insert(Object* obj);
+    // Only after marking finished, it does not lock.
+    bool Contains(Object* obj) const;
+
+private:
+    static constexpr size_t kMaxProbes = 32;
+
+    size_t Hash(const Object* obj) const {
+        return (reinterpret_cast<uintptr_t>(obj) * 0x9E3779B97F4A7C15ull) >> shift_;
+    }
+
+    std::unique_ptr<std::atomic<Object*>[]> slots_;
+    size_t mask_;
+    int shift_;
+    std::mutex overflow_mutex_;
+    std::unordered_set<Object*> overflow_;
+};
+
+// Marks everything reachable from roots on up to threads threads, zero means one per core,
+// expected is about how many objects are reachable. Each thread works on a private stack and
+// shares part of it when it grows, threads which run out steal from the shared parts. References
+// are followed through Object::CollectRefs.
+std::unique_ptr<MarkSet> ParallelMark(std::span<Object* const> roots, size_t threads,
+                                      size_t expected);
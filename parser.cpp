@@ -1,12 +1,19 @@
 #pragma once
 
+#include <algorithm>
+#include <exception>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include "object.h"
 #include "tokenizer.h"
 #include "parser.h"
+#include "literal_pool.h"
+#include "trace.h"
 
 Object* Read(Tokenizer* obj, GarbageCollector* collector) {
+    TraceSpan span(TraceKind::PARSE, "read");
     auto res = TryRead(obj, collector);
     if (!obj->IsEnd()) {
         obj->ReadAll();
@@ -15,11 +22,155 @@ Object* Read(Tokenizer* obj, GarbageCollector* collector) {
     return res;
 }
 
-Object* TryRead(Tokenizer* obj, GarbageCollector* collector) {
+Object* ReadDatum(Tokenizer* obj, GarbageCollector* collector) {
+    enum class FrameKind { LIST, QUOTE };
+    struct Frame {
+        FrameKind kind;
+        // Elements of the list start here in items.
+        size_t start;
+        bool dotted = false;
+        bool has_tail = false;
+        Object* tail = nullptr;
+    };
+    auto pool = collector->Literals();
+    std::vector<Frame> frames;
+    std::vector<Object*> items;
+
+    while (true) {
+        if (obj->IsEnd()) {
+            throw SyntaxError(frames.empty() ? "The end of enter" : "Unexpected end in read list");
+        }
+        Token next = obj->GetToken();
+        obj->Next();
+        Object* datum = nullptr;
+        if (BracketToken* bt = std::get_if<BracketToken>(&next)) {
+            if (*bt == BracketToken::OPEN) {
+                frames.push_back({FrameKind::LIST, items.size()});
+                continue;
+            }
+            if (frames.empty() || frames.back().kind != FrameKind::LIST) {
+                throw SyntaxError("Close bracket into read");
+            }
+            auto& frame = frames.back();
+            if (frame.dotted && !frame.has_tail) {
+                throw SyntaxError("Bad pair expression");
+            }
+            datum = frame.tail;
+            for (size_t i = items.size(); i != frame.start; --i) {
+                datum = collector->AddObj(new Cell(items[i - 1], datum, collector));
+            }
+            items.resize(frame.start);
+            frames.pop_back();
+        } else if (std::get_if<QuoteToken>(&next)) {
+            frames.push_back({FrameKind::QUOTE, items.size()});
+            continue;
+        } else if (std::get_if<DotToken>(&next)) {
+            if (frames.empty() || frames.back().kind != FrameKind::LIST ||
+                frames.back().start == items.size() || frames.back().dotted) {
+                throw SyntaxError("Bad pair expression");
+            }
+            frames.back().dotted = true;
+            continue;
+        } else if (SymbolToken* st = std::get_if<SymbolToken>(&next)) {
+            if (st->name == "#t" || st->name == "#f") {
+                datum = GetBoolConstant(st->name == "#t");
+            } else if (!(datum = pool ? pool->GetSymbol(st->name) : nullptr)) {
+                datum = collector->AddObj(new Symbol(st->name));
+            }
+        } else if (ConstantToken* ct = std::get_if<ConstantToken>(&next)) {
+            if (!(datum = pool ? pool->GetNumber(ct->value) : nullptr)) {
+                datum = collector->AddObj(new Number(ct->value));
+            }
+        } else if (StringToken* st = std::get_if<StringToken>(&next)) {
+            if (!(datum = pool ? pool->GetString(st->value) : nullptr)) {
+                datum = collector->AddObj(new String(Rope(std::move(st->value))));
+            }
+        }
+
+        // The datum is complete, it goes into the innermost unfinished list.
+        while (true) {
+            if (frames.empty()) {
+                return datum;
+            }
+            auto& frame = frames.back();
+            if (frame.kind == FrameKind::QUOTE) {
+                auto rest = collector->AddObj(new Cell(datum, nullptr, collector));
+                datum = collector->AddObj(new Cell(collector->AddObj(new Symbol("quote")), rest));
+                frames.pop_back();
+                continue;
+            }
+            if (frame.has_tail) {
+                throw SyntaxError("Pair into middle or beginning of list");
+            } else if (frame.dotted) {
+                frame.tail = datum;
+                frame.has_tail = true;
+            } else {
+                items.push_back(datum);
+            }
+            break;
+        }
+    }
+}
+
+std::vector<Object*> ReadData(std::string_view text, GarbageCollector* collector) {
+    TraceSpan span(TraceKind::PARSE, "read-data", text.size());
+    Tokenizer tokenizer{text};
+    std::vector<Object*> res;
+    while (!tokenizer.IsEnd()) {
+        res.push_back(ReadDatum(&tokenizer, collector));
+    }
+    return res;
+}
+
+std::vector<Object*> ReadForms(std::string_view text, GarbageCollector* collector,
+                               size_t threads) {
+    TraceSpan span(TraceKind::PARSE, "read-forms", text.size());
+    // Smaller pieces are not worth a thread.
+    const size_t min_piece = 1 << 16;
+    auto bounds = SplitForms(text, std::clamp<size_t>(text.size() / min_piece, 1, threads));
+    size_t parts = bounds.size() - 1;
+    std::vector<std::vector<Object*>> forms(parts);
+    std::vector<std::unique_ptr<GarbageCollector>> memory(parts);
+    std::vector<std::exception_ptr> errors(parts);
+    auto read_part = [&](size_t i) {
+        TraceSpan piece_span(TraceKind::PARSE, "read-piece", bounds[i + 1] - bounds[i]);
+        memory[i] = std::make_unique<GarbageCollector>();
+        memory[i]->SetLiterals(collector->Literals());
+        try {
+            Tokenizer tokenizer{text.substr(bounds[i], bounds[i + 1] - bounds[i])};
+            while (!tokenizer.IsEnd()) {
+                forms[i].push_back(TryRead(&tokenizer, memory[i].get()));
+            }
+        } catch (...) {
+            errors[i] = std::current_exception();
+        }
+    };
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < parts; ++i) {
+        workers.emplace_back(read_part, i);
+    }
+    read_part(0);
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    std::vector<Object*> res;
+    for (size_t i = 0; i != parts; ++i) {
+        collector->Adopt(memory[i].get());
+        if (errors[i]) {
+            std::rethrow_exception(errors[i]);
+        }
+        res.insert(res.end(), forms[i].begin(), forms[i].end());
+    }
+    return res;
+}
+
+Object* TryRead(Tokenizer* obj, GarbageCollector* collector, bool quoted) {
     if (obj->IsEnd()) {
         throw SyntaxError("The end of enter");
     }
     Token next = obj->GetToken();
+    auto pool = collector->Literals();
 
     if (BracketToken* bt = std::get_if<BracketToken>(&next)) {
         if (*bt == BracketToken::OPEN) {
@@ -30,7 +181,7 @@ Object* TryRead(Tokenizer* obj, GarbageCollector* collector) {
                 std::get<1>(next_next) == BracketToken::CLOSE) {
                 res = nullptr;
             } else {
-                res = ReadList(obj, collector);
+                res = ReadList(obj, collector, quoted);
             }
             obj->Next();
             return res;
@@ -39,30 +190,54 @@ Object* TryRead(Tokenizer* obj, GarbageCollector* collector) {
         }
     } else if (std::get_if<QuoteToken>(&next)) {
         obj->Next();
-        auto object = TryRead(obj, collector);
+        auto object = TryRead(obj, collector, true);
+        if (auto res = pool ? pool->GetQuote(object) : nullptr) {
+            return res;
+        }
         return collector->AddObj(new Quote(object));
     } else if (std::get_if<DotToken>(&next)) {
         obj->Next();
-        auto object = TryRead(obj, collector);
+        auto object = TryRead(obj, collector, quoted);
         return collector->AddObj(new Pair(nullptr, object));
     } else if (SymbolToken* st = std::get_if<SymbolToken>(&next)) {
         obj->Next();
         if (st->name == "#t" || st->name == "#f") {
-            return collector->AddObj(new Boolean(st->name));
+            return GetBoolConstant(st->name == "#t");
+        }
+        if (auto res = pool && quoted ? pool->GetSymbol(st->name) : nullptr) {
+            return res;
         }
         return collector->AddObj(new Symbol(st->name));
     } else if (ConstantToken* ct = std::get_if<ConstantToken>(&next)) {
         obj->Next();
+        if (auto res = pool ? pool->GetNumber(ct->value) : nullptr) {
+            return res;
+        }
         return collector->AddObj(new Number(ct->value));
+    } else if (StringToken* st = std::get_if<StringToken>(&next)) {
+        obj->Next();
+        if (auto res = pool ? pool->GetString(st->value) : nullptr) {
+            return res;
+        }
+        return collector->AddObj(new String(Rope(std::move(st->value))));
     }
 
     throw SyntaxError("Token was not found");
 }
 
+// A number as the second of two operands makes a fused node, see ImmediateOperation.
+template <template <size_t> class Func, template <size_t> class Operation, size_t kIndex>
+Object* MakeOperation(const std::vector<Object*>& objects, GarbageCollector* collector) {
+    if (objects.size() == 3 && dynamic_cast<Number*>(objects[2])) {
+        return collector->AddNode<ImmediateOperation<Operation<kIndex>>>(objects.begin() + 1,
+                                                                         objects.end());
+    }
+    return collector->AddNode<Func<kIndex>>(objects.begin() + 1, objects.end());
+}
+
 Object* GetIfFunction(const std::vector<Object*>& objects, GarbageCollector* collector) {
     if (dynamic_cast<Function*>(objects[0]) || dynamic_cast<FunctionHolder*>(objects[0])) {
-        return collector->AddObj(
-            new FunctionHolder(objects[0], objects.begin() + 1, objects.end()));
+        return collector->AddNode<FunctionHolder>(objects.begin() + 1, objects.end(), objects[0]);
     }
     Symbol* first_one = dynamic_cast<Symbol*>(objects[0]);
     if (!first_one) {
@@ -73,54 +248,164 @@ Object* GetIfFunction(const std::vector<Object*>& objects, GarbageCollector* col
     if (command == "quote") {
         return collector->AddObj(new Quote(objects[1]));
     }
-    std::vector<std::string> operators = {"<", ">", "<=", ">=", "="};
-    for (size_t i = 0; i != operators.size(); ++i) {
-        if (operators[i] == command) {
-            return collector->AddObj(new GoodOperatorFunc(i, objects.begin() + 1, objects.end()));
-        }
-    }
-    std::unordered_set<std::string> operations = {"+", "*", "-", "/"};
-    if (operations.contains(command)) {
-        return collector->AddObj(new AddSubOthersFunc(command, objects.begin() + 1, objects.end()));
+    using MakeOperator = Object* (*)(const std::vector<Object*>&, GarbageCollector*);
+    static const std::unordered_map<std::string, MakeOperator> kOperators = {
+        {"<", MakeOperation<GoodOperatorFunc, ComparingStructure, 0>},
+        {">", MakeOperation<GoodOperatorFunc, ComparingStructure, 1>},
+        {"<=", MakeOperation<GoodOperatorFunc, ComparingStructure, 2>},
+        {">=", MakeOperation<GoodOperatorFunc, ComparingStructure, 3>},
+        {"=", MakeOperation<GoodOperatorFunc, ComparingStructure, 4>},
+        {"+", MakeOperation<AddSubOthersFunc, OperatorHelper, 0>},
+        {"*", MakeOperation<AddSubOthersFunc, OperatorHelper, 1>},
+        {"-", MakeOperation<AddSubOthersFunc, OperatorHelper, 2>},
+        {"/", MakeOperation<AddSubOthersFunc, OperatorHelper, 3>},
+    };
+    if (auto it = kOperators.find(command); it != kOperators.end()) {
+        return it->second(objects, collector);
     }
     if (command == "min" || command == "max") {
-        return collector->AddObj(new MinMax(command, objects.begin() + 1, objects.end()));
+        return collector->AddNode<MinMax>(objects.begin() + 1, objects.end(), command);
     } else if (command == "not") {
-        return collector->AddObj(new BoolNotFunc(objects.begin() + 1, objects.end()));
+        return collector->AddNode<BoolNotFunc>(objects.begin() + 1, objects.end());
     } else if (command == "abs") {
-        return collector->AddObj(new AbsFunc(objects.begin() + 1, objects.end()));
+        return collector->AddNode<AbsFunc>(objects.begin() + 1, objects.end());
     } else if (command == "or" || command == "and") {
-        return collector->AddObj(
-            new BoolLogicOperation(command, objects.begin() + 1, objects.end()));
+        return collector->AddNode<BoolLogicOperation>(objects.begin() + 1, objects.end(), command);
+    } else if (command == "string-length" || command == "substring" ||
+               command == "string-append" || command == "string=?" || command == "string->symbol") {
+        return collector->AddNode<StringOperation>(objects.begin() + 1, objects.end(), command);
     } else if (command.back() == '?') {
-        return collector->AddObj(new IsType(command, objects.begin() + 1, objects.end()));
+        return collector->AddNode<IsType>(objects.begin() + 1, objects.end(), command);
+    } else if (command == "load") {
+        return collector->AddNode<LoadFunc>(objects.begin() + 1, objects.end());
+    } else if (command == "read") {
+        return collector->AddNode<ReadFunc>(objects.begin() + 1, objects.end());
     } else if (command == "cons") {
-        return collector->AddObj(new ConsFunc(objects.begin() + 1, objects.end()));
+        return collector->AddNode<ConsFunc>(objects.begin() + 1, objects.end());
     } else if (command == "car" || command == "cdr") {
-        return collector->AddObj(new GetPairElemFunc(command, objects.begin() + 1, objects.end()));
+        return collector->AddNode<GetPairElemFunc>(objects.begin() + 1, objects.end(), command);
     } else if (command == "list") {
-        return collector->AddObj(new MakeList(objects.begin() + 1, objects.end()));
+        return collector->AddNode<MakeList>(objects.begin() + 1, objects.end());
+    } else if (command == "length") {
+        return collector->AddNode<ListLength>(objects.begin() + 1, objects.end());
     } else if (command == "list-ref" || command == "list-tail") {
-        return collector->AddObj(new GetPartList(command, objects.begin() + 1, objects.end()));
+        return collector->AddNode<GetPartList>(objects.begin() + 1, objects.end(), command);
     } else if (command == "define") {
-        return collector->AddObj(new Define(objects.begin() + 1, objects.end()));
+        return collector->AddNode<Define>(objects.begin() + 1, objects.end());
+    } else if (command == "define-memoized") {
+        return collector->AddNode<DefineMemoized>(objects.begin() + 1, objects.end());
+    } else if (command == "memo-stats") {
+        return collector->AddNode<MemoStats>(objects.begin() + 1, objects.end());
     } else if (command == "set!") {
-        return collector->AddObj(new Set(objects.begin() + 1, objects.end()));
+        return collector->AddNode<Set>(objects.begin() + 1, objects.end());
     } else if (command == "set-car!" || command == "set-cdr!") {
-        return collector->AddObj(new SetPairElem(command, objects.begin() + 1, objects.end()));
+        return collector->AddNode<SetPairElem>(objects.begin() + 1, objects.end(), command);
+    } else if (command == "let" || command == "let*" || command == "letrec") {
+        return collector->AddNode<LetFunc>(objects.begin() + 1, objects.end(), command);
+    } else if (command == "do") {
+        return collector->AddNode<DoFunc>(objects.begin() + 1, objects.end());
+    } else if (command == "begin") {
+        return collector->AddNode<BeginFunc>(objects.begin() + 1, objects.end());
     } else if (command == "if") {
-        return collector->AddObj(new IfFunc(objects.begin() + 1, objects.end()));
+        return collector->AddNode<IfFunc>(objects.begin() + 1, objects.end());
+    } else if (command == "spawn") {
+        return collector->AddNode<SpawnFunc>(objects.begin() + 1, objects.end());
+    } else if (command == "yield") {
+        return collector->AddNode<YieldFunc>(objects.begin() + 1, objects.end());
+    } else if (command == "make-channel") {
+        return collector->AddNode<MakeChannel>(objects.begin() + 1, objects.end());
+    } else if (command == "channel-send" || command == "channel-receive") {
+        return collector->AddNode<ChannelOperation>(objects.begin() + 1, objects.end(), command);
+    } else if (command == "make-hash-table") {
+        return collector->AddNode<MakeHashTable>(objects.begin() + 1, objects.end());
+    } else if (command == "hash-ref" || command == "hash-set!" || command == "hash-remove!" ||
+               command == "hash-count") {
+        return collector->AddNode<HashTableOperation>(objects.begin() + 1, objects.end(), command);
     } else if (command == "lambda") {
         if (objects.size() <= 2) {
             throw SyntaxError("Wrong count of args in lambda init");
         }
         return collector->AddObj(new LambdaFunc(objects.begin() + 1, objects.end()));
     } else {
-        return collector->AddObj(new Holder(objects.begin(), objects.end()));
+        return collector->AddNode<Holder>(objects.begin(), objects.end());
+    }
+}
+
+// Cells of a quoted list are pooled while all of their elements are.
+static Object* MakeCell(Object* first, Object* second, GarbageCollector* collector, bool quoted) {
+    auto pool = collector->Literals();
+    if (auto res = pool && quoted ? pool->GetCell(first, second) : nullptr) {
+        return res;
+    }
+    return collector->AddObj(new Cell(first, second, collector));
+}
+
+// Whether the next element of the list is the bindings of let, named let or do.
+static bool BindingsFollow(const std::vector<Object*>& objects) {
+    auto head = objects.empty() ? nullptr : dynamic_cast<Symbol*>(objects[0]);
+    if (!head) {
+        return false;
     }
+    const auto& name = head->GetName();
+    if (objects.size() == 1) {
+        return name == "let" || name == "let*" || name == "letrec" || name == "do";
+    }
+    return objects.size() == 2 && name == "let" && dynamic_cast<Symbol*>(objects[1]);
+}
+
+// Bindings are data, each one is kept as a holder of its name and operands, so a binding named
+// like a built-in form, e.g. max or done?, does not become that form. The operands are read as
+// usual.
+static Object* ReadBindings(Tokenizer* obj, GarbageCollector* collector, bool quoted) {
+    auto is_bracket = [obj](BracketToken kind) {
+        auto next = obj->GetToken();
+        auto bt = std::get_if<BracketToken>(&next);
+        return bt && *bt == kind;
+    };
+    if (!is_bracket(BracketToken::OPEN)) {
+        return TryRead(obj, collector, quoted);
+    }
+    obj->Next();
+    std::vector<Object*> bindings;
+    while (true) {
+        if (obj->IsEnd()) {
+            throw SyntaxError("Unexpected end in read list");
+        }
+        if (is_bracket(BracketToken::CLOSE)) {
+            obj->Next();
+            break;
+        }
+        if (!is_bracket(BracketToken::OPEN)) {
+            bindings.push_back(TryRead(obj, collector, quoted));
+            continue;
+        }
+        obj->Next();
+        std::vector<Object*> binding;
+        while (true) {
+            if (obj->IsEnd()) {
+                throw SyntaxError("Unexpected end in read list");
+            }
+            if (is_bracket(BracketToken::CLOSE)) {
+                obj->Next();
+                break;
+            }
+            binding.push_back(TryRead(obj, collector, quoted));
+            if (dynamic_cast<Pair*>(binding.back())) {
+                throw SyntaxError("Improper list in bindings");
+            }
+        }
+        bindings.push_back(binding.empty()
+                               ? nullptr
+                               : collector->AddNode<Holder>(binding.begin(), binding.end()));
+    }
+    Object* res = nullptr;
+    for (auto it = bindings.rbegin(); it != bindings.rend(); ++it) {
+        res = MakeCell(*it, res, collector, false);
+    }
+    return res;
 }
 
-Object* ReadList(Tokenizer* obj, GarbageCollector* collector) {
+Object* ReadList(Tokenizer* obj, GarbageCollector* collector, bool quoted) {
     if (obj->IsEnd()) {
         throw SyntaxError("Unexpected end in read list");
     }
@@ -134,32 +419,16 @@ Object* ReadList(Tokenizer* obj, GarbageCollector* collector) {
                 break;
             }
         }
-        auto ptr = TryRead(obj, collector);
-        if (!ptr) {
-            objects.push_back(nullptr);
-        } else if (auto np = dynamic_cast<Number*>(ptr)) {
-            objects.push_back(np);
-        } else if (auto sp = dynamic_cast<Symbol*>(ptr)) {
-            objects.push_back(sp);
-        } else if (auto bp = dynamic_cast<Boolean*>(ptr)) {
-            objects.push_back(bp);
-        } else if (auto pp = dynamic_cast<Pair*>(ptr)) {
+        // Elements are stored as read, only a dotted tail is merged into the previous one.
+        auto ptr = BindingsFollow(objects) ? ReadBindings(obj, collector, quoted)
+                                           : TryRead(obj, collector, quoted);
+        if (auto pp = dynamic_cast<Pair*>(ptr)) {
             if (objects.empty()) {
                 throw SyntaxError("Bad pair expression");
             }
             objects.back() = collector->AddObj(new Pair(objects.back(), pp->GetSecond()));
-        } else if (auto cp = dynamic_cast<Cell*>(ptr)) {
-            objects.push_back(cp);
-        } else if (auto qp = dynamic_cast<Quote*>(ptr)) {
-            objects.push_back(qp);
-        } else if (auto hp = dynamic_cast<Function*>(ptr)) {
-            objects.push_back(hp);
-        } else if (auto lh = dynamic_cast<FunctionHolder*>(ptr)) {
-            objects.push_back(lh);
-        } else if (auto h = dynamic_cast<Holder*>(ptr)) {
-            objects.push_back(h);
         } else {
-            throw SyntaxError("Unknown object during a list");
+            objects.push_back(ptr);
         }
     }
     auto func = GetIfFunction(objects, collector);
@@ -168,11 +437,11 @@ Object* ReadList(Tokenizer* obj, GarbageCollector* collector) {
     }
     Object* res;
     if (!objects.back()) {
-        res = collector->AddObj(new Cell(objects.back(), nullptr));
+        res = MakeCell(objects.back(), nullptr, collector, quoted);
     } else if (auto pp = dynamic_cast<Pair*>(&*objects.back())) {
-        res = collector->AddObj(new Cell(*pp));
+        res = MakeCell(pp->GetFirst(), pp->GetSecond(), collector, quoted);
     } else {
-        res = collector->AddObj(new Cell(objects.back(), nullptr));
+        res = MakeCell(objects.back(), nullptr, collector, quoted);
     }
     if (objects.size() == 1) {
         return res;
@@ -181,7 +450,7 @@ Object* ReadList(Tokenizer* obj, GarbageCollector* collector) {
         if (objects[i] && dynamic_cast<Pair*>(&*objects[i])) {
             throw SyntaxError("Pair into middle or beginning of list");
         } else {
-            res = collector->AddObj(new Cell(objects[i], res));
+            res = MakeCell(objects[i], res, collector, quoted);
         }
     }
     return res;
@@ -1,12 +1,25 @@
 #pragma once
 
 #include <memory>
+#include <string_view>
 #include <unordered_set>
 #include <vector>
 
 #include "function.h"
 #include "tokenizer.h"
 
-Object* TryRead(Tokenizer*, GarbageCollector*);
-Object* ReadList(Tokenizer*, GarbageCollector*);
+// Inside a quote symbols and lists are data and may come from the literal pool as well.
+Object* TryRead(Tokenizer*, GarbageCollector*, bool quoted = false);
+Object* ReadList(Tokenizer*, GarbageCollector*, bool quoted = false);
 Object* Read(Tokenizer*, GarbageCollector*);
+// Reads a datum the way quote sees it, but lists are always Cells whatever their head is, and
+// 'x reads as (quote x). Nesting is handled without recursion, so deep data cannot overflow the
+// stack.
+Object* ReadDatum(Tokenizer*, GarbageCollector*);
+std::vector<Object*> ReadData(std::string_view text, GarbageCollector* collector);
+// Reads every top-level form of text in order. Pieces of a large text are read on up to
+// threads threads, each into a collector of its own which collector adopts afterwards. The
+// first error in the text is rethrown.
+std::vector<Object*> ReadForms(std::string_view text, GarbageCollector* collector,
+                               size_t threads = 1);
+Object* GetIfFunction(const std::vector<Object*>&, GarbageCollector*);
@@ -0,0 +1,115 @@
+#include "rope.h"
+
+#include <algorithm>
+
+namespace {
+
+// Short pieces are copied together, a tree of single characters would cost more than the text.
+const size_t kShortPiece = 64;
+
+}  // namespace
+
+Rope::Rope(std::string text) {
+    if (!text.empty()) {
+        auto length = text.size();
+        node_ = MakeLeaf(std::make_shared<const std::string>(std::move(text)), 0, length);
+    }
+}
+
+Rope Rope::Substr(size_t pos, size_t count) const {
+    if (pos >= Length() || !count) {
+        return Rope();
+    }
+    return Rope(Slice(node_, pos, std::min(count, Length() - pos)));
+}
+
+Rope Rope::Append(const Rope& other) const {
+    if (!node_) {
+        return other;
+    }
+    if (!other.node_) {
+        return *this;
+    }
+    return Rope(Join(node_, other.node_));
+}
+
+std::string Rope::ToString() const {
+    std::string res;
+    res.reserve(Length());
+    ForEachPiece([&res](std::string_view piece) { res += piece; });
+    return res;
+}
+
+bool Rope::operator==(const Rope& other) const {
+    return node_ == other.node_ || (Length() == other.Length() && ToString() == other.ToString());
+}
+
+Rope::NodePtr Rope::MakeLeaf(std::shared_ptr<const std::string> storage, size_t offset,
+                             size_t length) {
+    auto node = std::make_shared<Node>();
+    node->length = length;
+    node->storage = std::move(storage);
+    node->offset = offset;
+    return node;
+}
+
+Rope::NodePtr Rope::MakeConcat(NodePtr left, NodePtr right) {
+    auto node = std::make_shared<Node>();
+    node->length = left->length + right->length;
+    node->depth = std::max(left->depth, right->depth) + 1;
+    node->left = std::move(left);
+    node->right = std::move(right);
+    return node;
+}
+
+// Joins two balanced trees as AVL trees are joined, so the depth stays logarithmic however
+// the text is built.
+Rope::NodePtr Rope::Join(const NodePtr& left, const NodePtr& right) {
+    if (left->depth > right->depth + 1) {
+        auto tail = Join(left->right, right);
+        if (tail->depth <= left->left->depth + 1) {
+            return MakeConcat(left->left, tail);
+        }
+        if (tail->left->depth > tail->right->depth) {
+            return MakeConcat(MakeConcat(left->left, tail->left->left),
+                              MakeConcat(tail->left->right, tail->right));
+        }
+        return MakeConcat(MakeConcat(left->left, tail->left), tail->right);
+    }
+    if (right->depth > left->depth + 1) {
+        auto head = Join(left, right->left);
+        if (head->depth <= right->right->depth + 1) {
+            return MakeConcat(head, right->right);
+        }
+        if (head->right->depth > head->left->depth) {
+            return MakeConcat(MakeConcat(head->left, head->right->left),
+                              MakeConcat(head->right->right, right->right));
+        }
+        return MakeConcat(head->left, MakeConcat(head->right, right->right));
+    }
+    if (left->storage && right->storage && left->length + right->length <= kShortPiece) {
+        auto text = std::make_shared<std::string>(*left->storage, left->offset, left->length);
+        text->append(*right->storage, right->offset, right->length);
+        auto length = text->size();
+        return MakeLeaf(std::move(text), 0, length);
+    }
+    return MakeConcat(left, right);
+}
+
+Rope::NodePtr Rope::Slice(const NodePtr& node, size_t pos, size_t count) {
+    if (pos == 0 && count == node->length) {
+        return node;
+    }
+    if (node->storage) {
+        return MakeLeaf(node->storage, node->offset + pos, count);
+    }
+    auto left_length = node->left->length;
+    if (pos + count <= left_length) {
+        return Slice(node->left, pos, count);
+    }
+    if (pos >= left_length) {
+        return Slice(node->right, pos - left_length, count);
+    }
+    return Join(Slice(node->left, pos, left_length - pos),
+                Slice(node->right, 0, pos + count - left_length));
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+
+// Immutable text. Substrings share the storage of their source and concatenation builds a
+// balanced tree of pieces, so neither of them copies long text.
+class Rope {
+public:
+    Rope() = default;
+    explicit Rope(std::string text);
+
+    size_t Length() const {
+        return node_ ? node_->length : 0;
+    }
+    Rope Substr(size_t pos, size_t count) const;
+    Rope Append(const Rope& other) const;
+    std::string ToString() const;
+    bool operator==(const Rope& other) const;
+
+    // Calls f for each piece of the text in order.
+    template <class F>
+    void ForEachPiece(F&& f) const {
+        ForEachPiece(node_.get(), f);
+    }
+
+private:
+    struct Node {
+        size_t length = 0;
+        uint32_t depth = 0;
+        // A leaf refers to a part of shared storage, an inner node joins two pieces.
+        std::shared_ptr<const std::string> storage;
+        size_t offset = 0;
+        std::shared_ptr<const Node> left;
+        std::shared_ptr<const Node> right;
+    };
+    using NodePtr = std::shared_ptr<const Node>;
+
+    explicit Rope(NodePtr node) : node_(std::move(node)) {
+    }
+
+    static NodePtr MakeLeaf(std::shared_ptr<const std::string> storage, size_t offset,
+                            size_t length);
+    static NodePtr MakeConcat(NodePtr left, NodePtr right);
+    static NodePtr Join(const NodePtr& left, const NodePtr& right);
+    static NodePtr Slice(const NodePtr& node, size_t pos, size_t count);
+
+    template <class F>
+    static void ForEachPiece(const Node* node, F& f) {
+        while (node) {
+            if (node->storage) {
+                f(std::string_view(*node->storage).substr(node->offset, node->length));
+                return;
+            }
+            ForEachPiece(node->left.get(), f);
+            node = node->right.get();
+        }
+    }
+
+    NodePtr node_;
+};
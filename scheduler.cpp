@@ -0,0 +1,103 @@
+#include "scheduler.h"
+
+#include <algorithm>
+#include <exception>
+
+namespace {
+
+// As deep as the stack of the main thread, pages of a fiber stack are committed only when the
+// recursion reaches them.
+const size_t kTaskStackSize = 8 << 20;
+
+}  // namespace
+
+Scheduler::~Scheduler() {
+    // Every unfinished task is resumed once more and unwinds its frames on the stop flag.
+    stopping_ = true;
+    while (!tasks_.empty()) {
+        running_ = tasks_.back().get();
+        try {
+            running_->Resume();
+        } catch (...) {
+        }
+        running_ = nullptr;
+        tasks_.pop_back();
+        collector_->Unpin();
+    }
+}
+
+void Scheduler::Spawn(std::function<void()> body) {
+    collector_->Pin();
+    tasks_.push_back(std::make_unique<Fiber>(
+        [this, body = std::move(body)] {
+            if (!stopping_) {
+                body();
+            }
+        },
+        kTaskStackSize));
+    ready_.push_back(tasks_.back().get());
+}
+
+void Scheduler::Switch() {
+    running_->Suspend();
+    if (stopping_) {
+        throw RuntimeError("Task is stopped");
+    }
+}
+
+void Scheduler::Yield() {
+    if (running_) {
+        ready_.push_back(running_);
+        Switch();
+        return;
+    }
+    for (size_t count = ready_.size(); count && RunOne(); --count) {
+    }
+}
+
+void Scheduler::Wait(std::deque<Fiber*>* waiters, const std::function<bool()>& ready) {
+    while (!ready()) {
+        if (running_) {
+            waiters->push_back(running_);
+            Switch();
+        } else if (!RunOne()) {
+            throw RuntimeError("Deadlock: no task can continue");
+        }
+    }
+}
+
+void Scheduler::Wake(std::deque<Fiber*>* waiters) {
+    if (!waiters->empty()) {
+        ready_.push_back(waiters->front());
+        waiters->pop_front();
+    }
+}
+
+void Scheduler::RunReady() {
+    while (RunOne()) {
+    }
+}
+
+bool Scheduler::RunOne() {
+    if (ready_.empty()) {
+        return false;
+    }
+    auto task = ready_.front();
+    ready_.pop_front();
+    running_ = task;
+    std::exception_ptr error;
+    try {
+        task->Resume();
+    } catch (...) {
+        error = std::current_exception();
+    }
+    running_ = nullptr;
+    if (task->IsFinished()) {
+        std::erase_if(tasks_, [task](const auto& el) { return el.get() == task; });
+        collector_->Unpin();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    return true;
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <deque>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "fiber.h"
+#include "memory_control.h"
+
+// Runs tasks of one interpreter on the thread which evaluates it. Tasks switch only in yield
+// and in blocking channel operations.
+class Scheduler {
+public:
+    explicit Scheduler(GarbageCollector* collector) : collector_(collector) {
+    }
+    Scheduler(const Scheduler&) = delete;
+    Scheduler& operator=(const Scheduler&) = delete;
+    ~Scheduler();
+
+    void Spawn(std::function<void()> body);
+    // In a task gives the turn to the next task, outside of tasks runs every ready task once.
+    void Yield();
+    // Returns when ready() holds. A task sleeps in waiters until Wake, outside of tasks other
+    // tasks run meanwhile.
+    void Wait(std::deque<Fiber*>* waiters, const std::function<bool()>& ready);
+    void Wake(std::deque<Fiber*>* waiters);
+    // Runs tasks until each of them has finished or is waiting.
+    void RunReady();
+
+private:
+    bool RunOne();
+    void Switch();
+
+    GarbageCollector* collector_;
+    std::vector<std::unique_ptr<Fiber>> tasks_;
+    std::deque<Fiber*> ready_;
+    Fiber* running_ = nullptr;
+    bool stopping_ = false;
+};
+
+class Channel : public Object {
+public:
+    Channel(size_t capacity) : capacity_(capacity) {
+    }
+
+    void Send(Scheduler* scheduler, Object* value) {
+        scheduler->Wait(&senders_, [this] { return values_.size() < capacity_; });
+        values_.push_back(value);
+        scheduler->Wake(&receivers_);
+    }
+    Object* Receive(Scheduler* scheduler) {
+        scheduler->Wait(&receivers_, [this] { return !values_.empty(); });
+        auto value = values_.front();
+        values_.pop_front();
+        scheduler->Wake(&senders_);
+        return value;
+    }
+
+    std::string Print(bool) const override {
+        return "#<channel>";
+    }
+    Object* Eval(Scope*) const override {
+        return std::remove_const_t<Channel*>(this);
+    }
+    void MarkAll(std::unordered_set<Object*>& need) const override {
+        need.insert(std::remove_const_t<Channel*>(this));
+        for (auto el : values_) {
+            if (el) {
+                el->MarkAll(need);
+            }
+        }
+    }
+    void CollectRefs(std::vector<Object*>& refs) const override {
+        for (auto el : values_) {
+            if (el) {
+                refs.push_back(el);
+            }
+        }
+    }
+    void Save(ImageWriter*) const override {
+        throw RuntimeError("Channel cannot be saved into image");
+    }
+
+private:
+    size_t capacity_;
+    std::deque<Object*> values_;
+    std::deque<Fiber*> senders_;
+    std::deque<Fiber*> receivers_;
+};
@@ -1,8 +1,17 @@
 #include "scheme.h"
 
+#include <algorithm>
+#include <exception>
+#include <optional>
+#include <thread>
+
+#include "bounded_queue.h"
+#include "module_cache.h"
+
 std::string EvalRes(Object* ptr, Scope* scope) {
     if (!ptr || dynamic_cast<Cell*>(ptr)) {
-        throw RuntimeError("List is given");
+        scope->Collector()->Fail(ErrorKind::RUNTIME, "List is given");
+        return {};
     } else if (auto np = dynamic_cast<Number*>(ptr)) {
         return np->Print(true);
     } else if (auto qp = dynamic_cast<Quote*>(ptr)) {
@@ -11,14 +20,206 @@ std::string EvalRes(Object* ptr, Scope* scope) {
         return sp->Print(true);
     } else if (auto bp = dynamic_cast<Boolean*>(ptr)) {
         return bp->Print(true);
+    } else if (auto stp = dynamic_cast<String*>(ptr)) {
+        return stp->Print(true);
     } else if (dynamic_cast<Function*>(ptr) || dynamic_cast<Holder*>(ptr) ||
                dynamic_cast<FunctionHolder*>(ptr)) {
         auto res = ptr->Eval(scope);
+        if (scope->Collector()->Failed()) {
+            return {};
+        }
         if (res) {
             return res->Print(true);
         } else {
             return "()";
         }
     }
-    throw RuntimeError("Wrong type of all expression");
+    scope->Collector()->Fail(ErrorKind::RUNTIME, "Wrong type of all expression");
+    return {};
+}
+
+Interpreter::Interpreter(Interpreter* parent)
+    : collector_(), overlay_(&parent->overlay_, &collector_),
+      scope_(&parent->scope_, &collector_, true), scheduler_(&collector_) {
+    collector_.SetScheduler(&scheduler_);
+    collector_.SetLiterals(&literals_);
+    collector_.SetPolicy(parent->collector_.Policy());
+    literals_.SetPolicy(parent->literals_.Policy());
+    collector_.ForkFrom(&parent->collector_);
+}
+
+std::unique_ptr<Interpreter> Interpreter::Fork() {
+    if (!collector_.Frozen()) {
+        FinishCollection();
+    }
+    if (collector_.Pinned()) {
+        throw RuntimeError("Cannot fork while an evaluation is suspended");
+    }
+    return std::unique_ptr<Interpreter>(new Interpreter(this));
+}
+
+void Interpreter::Clean(std::span<Object* const> roots) {
+    FinishCollection();
+    // Inside a task the stack of the running evaluation holds objects no scope refers to.
+    if (collector_.Pinned() && Fiber::Current()) {
+        return;
+    }
+    auto heap_bytes = collector_.HeapBytes();
+    TraceSpan span(TraceKind::GC, "gc", heap_bytes);
+    if (auto threads = collector_.Policy().mark_threads; threads != 1 && !collector_.Pinned()) {
+        collector_.FindAllObjects(*ParallelMark(Roots(roots), threads, ExpectedMarks()));
+    } else {
+        std::unordered_set<Object*> need;
+        for (auto obj : Roots(roots)) {
+            if (obj) {
+                obj->MarkAll(need);
+            }
+        }
+        if (collector_.Pinned()) {
+            collector_.CollectPinned(need);
+        } else {
+            collector_.FindAllObjects(need);
+        }
+    }
+    span.SetEndValue(heap_bytes - collector_.HeapBytes());
+}
+
+void Interpreter::CollectInBackground() {
+    FinishCollection();
+    if (collector_.Pinned()) {
+        return;
+    }
+    background_mark_ = std::async(std::launch::async, [roots = Roots({}),
+                                                       threads = collector_.Policy().mark_threads,
+                                                       expected = ExpectedMarks()] {
+        return ParallelMark(roots, threads, expected);
+    });
+}
+
+std::vector<Object*> Interpreter::Roots(std::span<Object* const> roots) {
+    std::vector<Object*> res;
+    scope_.ForEachBinding([&res](const std::string&, Object* obj) { res.push_back(obj); });
+    overlay_.ForEachValue([&res](Object* obj) { res.push_back(obj); });
+    res.insert(res.end(), roots.begin(), roots.end());
+    return res;
+}
+
+void Interpreter::FinishCollection() {
+    if (collector_.Frozen()) {
+        throw RuntimeError("Interpreter has live forks");
+    }
+    if (!background_mark_.valid()) {
+        return;
+    }
+    auto heap_bytes = collector_.HeapBytes();
+    TraceSpan span(TraceKind::GC, "sweep", heap_bytes);
+    collector_.FindAllObjects(*background_mark_.get());
+    span.SetEndValue(heap_bytes - collector_.HeapBytes());
+}
+
+EvalResult Interpreter::TryRun(const std::string& text) {
+    auto keep = collector_.KeepErrors(true);
+    std::optional<EvalError> thrown;
+    std::string res;
+    // Parse errors, errors of code which does not pass failures up and errors of the collection
+    // before the evaluation, such as live forks, still arrive here as exceptions. A kept error
+    // takes precedence since it happened first.
+    try {
+        FinishCollection();
+        if (collector_.NeedCollect()) {
+            Clean();
+        }
+        res = Evaluate(Parse(text, &collector_));
+    } catch (const SyntaxError& e) {
+        thrown = EvalError{ErrorKind::SYNTAX, e.what()};
+    } catch (const NameError& e) {
+        thrown = EvalError{ErrorKind::NAME, e.what()};
+    } catch (const std::exception& e) {
+        thrown = EvalError{ErrorKind::RUNTIME, e.what()};
+    }
+    collector_.KeepErrors(keep);
+    if (auto error = collector_.TakeError()) {
+        return std::move(*error);
+    }
+    if (thrown) {
+        return std::move(*thrown);
+    }
+    return res;
+}
+
+namespace {
+
+struct ParsedExpr {
+    Object* obj = nullptr;
+    std::unique_ptr<GarbageCollector> memory;
+    std::exception_ptr error;
+};
+
+}  // namespace
+
+std::vector<std::string> Interpreter::RunBatch(std::span<const std::string> texts,
+                                               bool pipelined) {
+    FinishCollection();
+    std::vector<std::string> results;
+    if (!pipelined) {
+        for (const auto& text : texts) {
+            results.push_back(Run(text));
+        }
+        return results;
+    }
+
+    BoundedQueue<ParsedExpr> queue(64);
+    std::thread parser([&] {
+        for (const auto& text : texts) {
+            ParsedExpr parsed{nullptr, std::make_unique<GarbageCollector>(), nullptr};
+            parsed.memory->SetLiterals(&literals_);
+            try {
+                parsed.obj = Parse(text, parsed.memory.get());
+            } catch (...) {
+                parsed.error = std::current_exception();
+            }
+            if (!queue.Push(parsed)) {
+                return;
+            }
+        }
+    });
+
+    try {
+        for (size_t i = 0; i != texts.size(); ++i) {
+            auto parsed = queue.Pop();
+            if (parsed->error) {
+                std::rethrow_exception(parsed->error);
+            }
+            if (collector_.NeedCollect()) {
+                Clean();
+            }
+            collector_.Adopt(parsed->memory.get());
+            results.push_back(Evaluate(parsed->obj));
+        }
+    } catch (...) {
+        queue.Close();
+        parser.join();
+        throw;
+    }
+    parser.join();
+    return results;
+}
+
+std::vector<std::string> Interpreter::RunFile(const std::string& path, size_t threads) {
+    if (!threads) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    FinishCollection();
+    if (collector_.NeedCollect()) {
+        Clean();
+    }
+    auto forms = ModuleCache::Shared().Read(path, &collector_, threads);
+    std::vector<std::string> results;
+    for (size_t i = 0; i != forms.size(); ++i) {
+        if (collector_.NeedCollect()) {
+            Clean(std::span(forms).subspan(i));
+        }
+        results.push_back(Evaluate(forms[i]));
+    }
+    return results;
 }
@@ -3,13 +3,23 @@
 #include "tokenizer.h"
 #include "parser.h"
 #include "function.h"
+#include "image.h"
+#include "evaluation.h"
+#include "eval_result.h"
+#include "literal_pool.h"
+#include "compiler.h"
+#include "trace.h"
+#include "heap_inspector.h"
+#include "parallel_mark.h"
 
 #include <iostream>
 #include <cassert>
 #include <cstdint>
 #include <functional>
+#include <future>
 #include <string>
 #include <random>
+#include <span>
 #include <tuple>
 #include <sstream>
 #include <vector>
@@ -18,33 +28,149 @@ std::string EvalRes(Object* ptr, Scope* scope);
 
 class Interpreter {
 public:
-    Interpreter() : collector_(), scope_(nullptr, &collector_) {
+    Interpreter()
+        : collector_(), overlay_(nullptr, &collector_), scope_(nullptr, &collector_),
+          scheduler_(&collector_) {
+        collector_.SetScheduler(&scheduler_);
+        collector_.SetLiterals(&literals_);
+    }
+
+    // Restores the global scope saved by SaveImage without parsing any source.
+    explicit Interpreter(const std::string& image_path) : Interpreter() {
+        LoadImage(image_path, &scope_, &collector_);
+    }
+
+    // A new interpreter which starts with everything defined here, without copying anything.
+    // The heap and the scopes are shared and stay unchanged while the fork lives, the fork
+    // keeps its definitions and the variables it sets to itself. Lists, hash tables and
+    // channels made here cannot be modified by the fork. This interpreter cannot evaluate or
+    // collect until its forks are destroyed and must outlive them, destroying a fork frees
+    // what the fork allocated. Forks may run on different threads at once.
+    std::unique_ptr<Interpreter> Fork();
+
+    void SaveImage(const std::string& path) {
+        ::SaveImage(path, &scope_);
     }
 
     std::string Run(const std::string& text) {
-        Clean();
-        std::stringstream ss{text};
-        Tokenizer tokenizer{&ss};
-        Object* obj = Read(&tokenizer, &collector_);
+        FinishCollection();
+        if (collector_.NeedCollect()) {
+            Clean();
+        }
+        return Evaluate(Parse(text, &collector_));
+    }
 
-        if (!obj) {
-            throw RuntimeError("Empty list is given");
-        } else if (auto sp = dynamic_cast<Symbol*>(obj)) {
-            if (scope_.Contains(sp->GetName())) {
-                return EvalRes(scope_.Get(sp->GetName()), &scope_);
-            }
-            throw NameError("Symbol is given");
+    // Like Run, but errors are returned instead of thrown. Inside the evaluation an error is
+    // passed up as a value, so a failure deep in recursion costs no more than a return.
+    EvalResult TryRun(const std::string& text);
+
+    // Results are returned in order, the first failed expression stops the batch and its
+    // error is rethrown. With pipelined set the next expression is parsed on a helper thread
+    // while the current one is evaluated.
+    std::vector<std::string> RunBatch(std::span<const std::string> texts, bool pipelined = false);
+
+    // Evaluates the top-level forms of a file in order, like RunBatch. The file is mapped and
+    // read on up to threads threads, zero means one per core. Parsed files are cached, see
+    // ModuleCache.
+    std::vector<std::string> RunFile(const std::string& path, size_t threads = 0);
+
+    // Lets the global functions compiled into a module run its code, see CompileDefinitions.
+    // The functions must already be defined, returns how many were bound.
+    size_t LoadCompiled(const std::string& path) {
+        FinishCollection();
+        return BindCompiled(path, &scope_);
+    }
+
+    // Evaluates text until limits are spent, the returned handle continues the evaluation.
+    // While the handle is unfinished only objects allocated since it last ran are collected.
+    std::unique_ptr<Evaluation> Start(const std::string& text, const EvalLimits& limits) {
+        FinishCollection();
+        if (collector_.NeedCollect()) {
+            Clean();
         }
-        return EvalRes(obj, &scope_);
+        auto obj = Parse(text, &collector_);
+        auto evaluation =
+            std::make_unique<Evaluation>(&collector_, [this, obj] { return Evaluate(obj); });
+        evaluation->Resume(limits);
+        return evaluation;
+    }
+
+    // Objects reachable from roots survive as well as the global scope. Marking runs on the
+    // threads GcPolicy::mark_threads asks for. While an evaluation or a task is suspended only
+    // objects allocated since it last ran may be freed, see GarbageCollector::CollectPinned.
+    void Clean(std::span<Object* const> roots = {});
+
+    // Marks on helper threads while the interpreter is idle. The next call which evaluates
+    // anything waits for the marking to finish and frees the garbage, which is a short pause
+    // when the marking is done by then. Does nothing while an evaluation is suspended.
+    void CollectInBackground();
+
+    void SetGcPolicy(const GcPolicy& policy) {
+        collector_.SetPolicy(policy);
+    }
+
+    void SetLiteralPolicy(const LiteralPolicy& policy) {
+        literals_.SetPolicy(policy);
+    }
+
+    size_t HeapBytes() const {
+        return collector_.HeapBytes();
     }
 
-    void Clean() {
-        std::unordered_set<Object*> need;
-        scope_.FindAllObjects(need);
-        collector_.FindAllObjects(need);
+    // What the heap holds and why, see HeapInspector.
+    HeapInspector Inspect() const {
+        return HeapInspector(&collector_, &scope_);
     }
 
 private:
+    explicit Interpreter(Interpreter* parent);
+
+    // Values of the global scope and of the overlay followed by roots.
+    std::vector<Object*> Roots(std::span<Object* const> roots);
+    // Bound on what marking reaches: the heap and the literal pool.
+    size_t ExpectedMarks() const {
+        return collector_.Objects() + literals_.Size();
+    }
+    // Called first by everything which evaluates or collects.
+    void FinishCollection();
+
+    static Object* Parse(const std::string& text, GarbageCollector* collector) {
+        Tokenizer tokenizer{std::string_view(text)};
+        return Read(&tokenizer, collector);
+    }
+
+    // Tasks spawned by the expression run after it, until all of them finish or wait.
+    std::string Evaluate(Object* obj) {
+        ForkOverlay::Active active(&overlay_);
+        std::string res;
+        if (!obj) {
+            collector_.Fail(ErrorKind::RUNTIME, "Empty list is given");
+        } else if (auto sp = dynamic_cast<Symbol*>(obj)) {
+            // The global scope of a fork continues in the one it was forked from.
+            auto cur = &scope_;
+            while (cur && !cur->Contains(sp->GetName())) {
+                cur = cur->Parent();
+            }
+            if (!cur) {
+                collector_.Fail(ErrorKind::NAME, "Symbol is given");
+            } else {
+                res = EvalRes(cur->Get(sp->GetName()), &scope_);
+            }
+        } else {
+            res = EvalRes(obj, &scope_);
+        }
+        if (collector_.Failed()) {
+            return {};
+        }
+        scheduler_.RunReady();
+        return res;
+    }
+
+    LiteralPool literals_;
     GarbageCollector collector_;
+    ForkOverlay overlay_;
     Scope scope_;
+    Scheduler scheduler_;
+    // Destroyed first, which waits for the marking threads.
+    std::future<std::unique_ptr<MarkSet>> background_mark_;
 };
@@ -1 +1,261 @@
 #include "tokenizer.h"
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <limits>
+#include <stdexcept>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+enum CharClass : uint8_t {
+    kSpace = 1,
+    kDigit = 2,
+    kValid = 4,
+    kSymbol = 8,
+    kPlain = 16,
+    kInert = 32,
+};
+
+// Same classes as Tokenizer::ValidChar and Tokenizer::StringChar give in the C locale.
+constexpr std::array<uint8_t, 256> MakeClasses() {
+    std::array<uint8_t, 256> res{};
+    for (int ch = 0; ch != 256; ++ch) {
+        bool alpha = (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z');
+        bool digit = ch >= '0' && ch <= '9';
+        std::string_view valid = "+-().'\"<=>*#/";
+        std::string_view symbol = ".'<=>*#/!?-";
+        if (ch == ' ' || (ch >= '\t' && ch <= '\r')) {
+            res[ch] |= kSpace;
+        }
+        if (digit) {
+            res[ch] |= kDigit;
+        }
+        if (alpha || digit || valid.find(ch) != std::string_view::npos) {
+            res[ch] |= kValid;
+        }
+        if (alpha || digit || symbol.find(ch) != std::string_view::npos) {
+            res[ch] |= kSymbol;
+        }
+        if (ch != '"' && ch != '\\') {
+            res[ch] |= kPlain;
+        }
+        if (ch != '"' && ch != '(' && ch != ')') {
+            res[ch] |= kInert;
+        }
+    }
+    return res;
+}
+
+constexpr std::array<uint8_t, 256> kClasses = MakeClasses();
+
+bool Is(char ch, CharClass cls) {
+    return kClasses[static_cast<unsigned char>(ch)] & cls;
+}
+
+#ifdef __SSE2__
+
+__m128i InRange(__m128i x, char lo, char hi) {
+    auto above = _mm_cmpeq_epi8(_mm_max_epu8(x, _mm_set1_epi8(lo)), x);
+    auto below = _mm_cmpeq_epi8(_mm_min_epu8(x, _mm_set1_epi8(hi)), x);
+    return _mm_and_si128(above, below);
+}
+
+__m128i Equal(__m128i x, char ch) {
+    return _mm_cmpeq_epi8(x, _mm_set1_epi8(ch));
+}
+
+// Lanes of the 16 bytes which belong to the class.
+template <CharClass cls>
+__m128i Match(__m128i x) {
+    if constexpr (cls == kSpace) {
+        return _mm_or_si128(Equal(x, ' '), InRange(x, '\t', '\r'));
+    } else if constexpr (cls == kDigit) {
+        return InRange(x, '0', '9');
+    } else if constexpr (cls == kSymbol) {
+        auto res = InRange(_mm_or_si128(x, _mm_set1_epi8(0x20)), 'a', 'z');
+        res = _mm_or_si128(res, InRange(x, '-', '9'));
+        res = _mm_or_si128(res, InRange(x, '<', '?'));
+        res = _mm_or_si128(res, _mm_or_si128(Equal(x, '!'), Equal(x, '#')));
+        return _mm_or_si128(res, _mm_or_si128(Equal(x, '\''), Equal(x, '*')));
+    } else if constexpr (cls == kPlain) {
+        return _mm_andnot_si128(_mm_or_si128(Equal(x, '"'), Equal(x, '\\')), _mm_set1_epi8(-1));
+    } else {
+        static_assert(cls == kInert);
+        auto bracket = _mm_or_si128(Equal(x, '('), Equal(x, ')'));
+        return _mm_andnot_si128(_mm_or_si128(bracket, Equal(x, '"')), _mm_set1_epi8(-1));
+    }
+}
+
+#endif
+
+// Position of the first character from pos on which is not in the class.
+template <CharClass cls>
+size_t Skip(std::string_view text, size_t pos) {
+#ifdef __SSE2__
+    while (pos + 16 <= text.size()) {
+        auto x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text.data() + pos));
+        unsigned rest = ~_mm_movemask_epi8(Match<cls>(x)) & 0xFFFF;
+        if (rest) {
+            return pos + __builtin_ctz(rest);
+        }
+        pos += 16;
+    }
+#endif
+    while (pos < text.size() && Is(text[pos], cls)) {
+        ++pos;
+    }
+    return pos;
+}
+
+// Position after the closing quote of a string, or the end of text if there is none.
+size_t SkipString(std::string_view text, size_t pos) {
+    while (true) {
+        pos = Skip<kPlain>(text, pos);
+        if (pos >= text.size()) {
+            return text.size();
+        }
+        if (text[pos] == '"') {
+            return pos + 1;
+        }
+        pos += 2;
+    }
+}
+
+}  // namespace
+
+std::vector<TokenSpan> ScanTokens(std::string_view text) {
+    std::vector<TokenSpan> res;
+    res.reserve(text.size() / 16 + 1);
+    size_t pos = 0;
+    while (true) {
+        pos = Skip<kSpace>(text, pos);
+        if (pos == text.size()) {
+            res.push_back({pos, 0, SpanKind::END});
+            return res;
+        }
+        char ch = text[pos];
+        size_t end = pos + 1;
+        SpanKind kind;
+        if (ch == '(') {
+            kind = SpanKind::OPEN;
+        } else if (ch == ')') {
+            kind = SpanKind::CLOSE;
+        } else if (ch == '.') {
+            kind = SpanKind::DOT;
+        } else if (ch == '\'') {
+            kind = SpanKind::QUOTE;
+        } else if (ch == '"') {
+            kind = SpanKind::STRING;
+            end = SkipString(text, end);
+        } else if (Is(ch, kDigit) || ch == '+' || ch == '-') {
+            if (!Is(ch, kDigit) && (end == text.size() || !Is(text[end], kDigit))) {
+                kind = SpanKind::SYMBOL;
+            } else {
+                kind = SpanKind::NUMBER;
+                end = Skip<kDigit>(text, end);
+            }
+        } else if (Is(ch, kValid)) {
+            kind = SpanKind::SYMBOL;
+            end = Skip<kSymbol>(text, end);
+        } else {
+            res.push_back({pos, 0, SpanKind::INVALID});
+            return res;
+        }
+        if (end - pos > std::numeric_limits<uint32_t>::max()) {
+            throw SyntaxError("Token is too long");
+        }
+        res.push_back({pos, static_cast<uint32_t>(end - pos), kind});
+        pos = end;
+    }
+}
+
+std::vector<size_t> SplitForms(std::string_view text, size_t parts) {
+    std::vector<size_t> res{0};
+    size_t step = text.size() / std::max<size_t>(parts, 1);
+    size_t depth = 0;
+    size_t pos = 0;
+    while (res.size() < parts) {
+        pos = Skip<kInert>(text, pos);
+        if (pos == text.size()) {
+            break;
+        }
+        char ch = text[pos++];
+        if (ch == '"') {
+            pos = SkipString(text, pos);
+        } else if (ch == '(') {
+            ++depth;
+        } else if (!depth) {
+            // A stray bracket, the reader reports it as it would for the whole text.
+            return {0, text.size()};
+        } else if (!--depth && pos - res.back() >= step && pos < text.size() &&
+                   (Is(text[pos], kSpace) || Is(text[pos], kValid))) {
+            res.push_back(pos);
+        }
+    }
+    res.push_back(text.size());
+    return res;
+}
+
+void Tokenizer::NextSpan() {
+    const auto& span = spans_[current_];
+    if (span.kind == SpanKind::END || span.kind == SpanKind::INVALID) {
+        GetToken();
+    }
+    ++current_;
+    size_t end = span.begin + span.length;
+    if (end < text_.size() && !Is(text_[end], kValid) && !Is(text_[end], kSpace)) {
+        throw SyntaxError("Next switched to unknown letter");
+    }
+}
+
+Token Tokenizer::MakeToken(const TokenSpan& span) const {
+    auto text = text_.substr(span.begin, span.length);
+    switch (span.kind) {
+        case SpanKind::OPEN:
+            return BracketToken::OPEN;
+        case SpanKind::CLOSE:
+            return BracketToken::CLOSE;
+        case SpanKind::DOT:
+            return DotToken();
+        case SpanKind::QUOTE:
+            return QuoteToken();
+        case SpanKind::SYMBOL:
+            return SymbolToken{std::string(text)};
+        case SpanKind::NUMBER: {
+            // Like std::stoi, which the stream reader uses.
+            auto digits = text.front() == '+' ? text.substr(1) : text;
+            int value = 0;
+            auto [_, error] = std::from_chars(digits.data(), digits.data() + digits.size(), value);
+            if (error == std::errc::result_out_of_range) {
+                throw std::out_of_range("stoi");
+            }
+            return ConstantToken{value};
+        }
+        case SpanKind::STRING: {
+            std::string res;
+            for (size_t i = 1; i < text.size(); ++i) {
+                if (text[i] == '"') {
+                    return StringToken{std::move(res)};
+                } else if (text[i] != '\\') {
+                    res.push_back(text[i]);
+                } else if (++i == text.size()) {
+                    throw SyntaxError("Unknown escape in string");
+                } else if (text[i] == 'n') {
+                    res.push_back('\n');
+                } else if (text[i] == '"' || text[i] == '\\') {
+                    res.push_back(text[i]);
+                } else {
+                    throw SyntaxError("Unknown escape in string");
+                }
+            }
+            throw SyntaxError("Unterminated string");
+        }
+        default:
+            throw SyntaxError("Unknown letter");
+    }
+}
@@ -1,10 +1,13 @@
 #pragma once
 
 #include <cassert>
+#include <cstdint>
 #include <iostream>
 #include <variant>
 #include <optional>
 #include <istream>
+#include <string_view>
+#include <vector>
 
 #include "error.h"
 
@@ -38,18 +41,55 @@ struct ConstantToken {
     }
 };
 
-using Token = std::variant<ConstantToken, BracketToken, SymbolToken, QuoteToken, DotToken>;
+struct StringToken {
+    std::string value;
+
+    bool operator==(const StringToken& other) const {
+        return value == other.value;
+    }
+};
+
+using Token =
+    std::variant<ConstantToken, BracketToken, SymbolToken, QuoteToken, DotToken, StringToken>;
+
+enum class SpanKind : uint8_t { OPEN, CLOSE, DOT, QUOTE, STRING, NUMBER, SYMBOL, END, INVALID };
+
+// Place of a token in the text. The index ends with an END span, or with an INVALID one at
+// the first character which cannot start a token.
+struct TokenSpan {
+    size_t begin;
+    uint32_t length;
+    SpanKind kind;
+};
+
+// Splits the whole text in one pass, runs of spaces, digits, symbol characters and string
+// characters are classified 16 bytes at a time where SSE2 is available.
+std::vector<TokenSpan> ScanTokens(std::string_view text);
+
+// Offsets which split text into at most parts pieces of about equal size, from 0 to the end of
+// text. Every split follows the closing bracket of a top-level list, so each piece holds whole
+// forms and tokenizes as it would inside the text. Brackets within strings are skipped.
+std::vector<size_t> SplitForms(std::string_view text, size_t parts);
 
 class Tokenizer {
 public:
     Tokenizer(std::istream* in) : stream_(in) {
     }
 
+    // Reads from the token index of text, which must outlive the tokenizer. Tokens and errors
+    // are the same as from a stream with this text, tokens are made only when asked for.
+    explicit Tokenizer(std::string_view text)
+        : stream_(nullptr), text_(text), spans_(ScanTokens(text)) {
+    }
+
     void ReadAll() {
         was_read_ = true;
     }
 
     bool IsEnd() {
+        if (!stream_) {
+            return was_read_ || spans_[current_].kind == SpanKind::END;
+        }
         auto start = stream_->rdbuf()->pubseekoff(0, std::ios_base::cur, std::ios_base::in);
         if (was_read_) {
             return true;
@@ -65,6 +105,10 @@ public:
     }
 
     void Next() {
+        if (!stream_) {
+            NextSpan();
+            return;
+        }
         if (next_pos_ == -1) {
             GetToken();
         }
@@ -79,7 +123,7 @@ public:
         if (isalpha(ch) || isdigit(ch) || ch == '+' || ch == '-') {
             return true;
         }
-        if (ch == ')' || ch == '(' || ch == '.' || ch == '\'') {
+        if (ch == ')' || ch == '(' || ch == '.' || ch == '\'' || ch == '"') {
             return true;
         }
         if (ch == '<' || ch == '=' || ch == '>' || ch == '*' || ch == '#' || ch == '/') {
@@ -89,7 +133,9 @@ public:
     }
 
     bool StringChar(int ch) {
-        return (ValidChar(ch) && !(ch == '-') && !(ch == '+') && !(ch == ')') && !(ch == '(')) || ch == '!' ||
+        return (ValidChar(ch) && !(ch == '-') && !(ch == '+') && !(ch == ')') && !(ch == '(') &&
+                !(ch == '"')) ||
+               ch == '!' ||
                ch == '?' ||
                ch == '-';
     }
@@ -99,6 +145,9 @@ public:
     }
 
     Token GetToken() {
+        if (!stream_) {
+            return MakeToken(spans_[current_]);
+        }
         std::istream::pos_type start = stream_->tellg();
         Token result;
         int ch = stream_->peek();
@@ -121,6 +170,9 @@ public:
         } else if (ch == '\'') {
             stream_->get();
             result = Token(QuoteToken());
+        } else if (ch == '"') {
+            stream_->get();
+            result = Token(StringToken{ReadString()});
         } else if (isdigit(ch) || ch == '+' || ch == '-') {
             std::string res(1, stream_->get());
             if ((ch == '-' || ch == '+') && !isdigit(stream_->peek())) {
@@ -145,7 +197,37 @@ public:
     }
 
 private:
+    void NextSpan();
+    Token MakeToken(const TokenSpan& span) const;
+
+    // Reads the rest of a string literal after its opening quote.
+    std::string ReadString() {
+        std::string res;
+        while (true) {
+            int ch = stream_->get();
+            if (ch == EOF) {
+                throw SyntaxError("Unterminated string");
+            } else if (ch == '"') {
+                return res;
+            } else if (ch == '\\') {
+                ch = stream_->get();
+                if (ch == 'n') {
+                    res.push_back('\n');
+                } else if (ch == '"' || ch == '\\') {
+                    res.push_back(ch);
+                } else {
+                    throw SyntaxError("Unknown escape in string");
+                }
+            } else {
+                res.push_back(ch);
+            }
+        }
+    }
+
     bool was_read_ = false;
     std::istream* stream_;
     std::istream::pos_type next_pos_ = -1;
+    std::string_view text_;
+    std::vector<TokenSpan> spans_;
+    size_t current_ = 0;
 };
@@ -0,0 +1,111 @@
+#include "trace.h"
+
+#include <algorithm>
+
+namespace {
+
+uint32_t ThreadIndex() {
+    static std::atomic<uint32_t> next{0};
+    thread_local const uint32_t index = ++next;
+    return index;
+}
+
+void AppendJsonString(std::string* out, const char* text) {
+    out->push_back('"');
+    for (; text && *text; ++text) {
+        if (*text == '"' || *text == '\\') {
+            out->push_back('\\');
+        }
+        out->push_back(*text);
+    }
+    out->push_back('"');
+}
+
+// Chrome expects microseconds.
+std::string Microseconds(uint64_t nanoseconds) {
+    auto fraction = std::to_string(nanoseconds % 1000);
+    return std::to_string(nanoseconds / 1000) + "." + std::string(3 - fraction.size(), '0') +
+           fraction;
+}
+
+}  // namespace
+
+void Tracer::Start() {
+    tracing_enabled.store(true, std::memory_order_relaxed);
+}
+
+void Tracer::Stop() {
+    tracing_enabled.store(false, std::memory_order_relaxed);
+}
+
+void Tracer::Record(TraceKind kind, TracePhase phase, const char* name, uint64_t value) {
+    auto time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - epoch_)
+                    .count();
+    auto index = head_.fetch_add(1, std::memory_order_relaxed);
+    auto& slot = slots_[index % kCapacity];
+    slot.sequence.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.time.store(time, std::memory_order_relaxed);
+    slot.name.store(name, std::memory_order_relaxed);
+    slot.value.store(value, std::memory_order_relaxed);
+    slot.thread.store(ThreadIndex(), std::memory_order_relaxed);
+    slot.kind.store(kind, std::memory_order_relaxed);
+    slot.phase.store(phase, std::memory_order_relaxed);
+    slot.sequence.store(index + 1, std::memory_order_release);
+}
+
+std::vector<TraceEvent> Tracer::Events() const {
+    auto head = head_.load(std::memory_order_acquire);
+    std::vector<TraceEvent> res;
+    res.reserve(std::min<uint64_t>(head, kCapacity));
+    for (auto index = head > kCapacity ? head - kCapacity : 0; index != head; ++index) {
+        const auto& slot = slots_[index % kCapacity];
+        if (slot.sequence.load(std::memory_order_acquire) != index + 1) {
+            continue;
+        }
+        TraceEvent event{slot.time.load(std::memory_order_relaxed),
+                         slot.name.load(std::memory_order_relaxed),
+                         slot.value.load(std::memory_order_relaxed),
+                         slot.thread.load(std::memory_order_relaxed),
+                         slot.kind.load(std::memory_order_relaxed),
+                         slot.phase.load(std::memory_order_relaxed)};
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.sequence.load(std::memory_order_relaxed) == index + 1) {
+            res.push_back(event);
+        }
+    }
+    return res;
+}
+
+std::string Tracer::ExportChrome() const {
+    static const char* kCategories[] = {"call", "gc", "parse", "scope"};
+    std::string res = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    uint64_t frames = 0;
+    bool first = true;
+    for (const auto& event : Events()) {
+        res += first ? "\n{" : ",\n{";
+        first = false;
+        res += "\"cat\":\"" + std::string(kCategories[static_cast<size_t>(event.kind)]) + "\",";
+        res += "\"ts\":" + Microseconds(event.time) + ",\"pid\":1,\"tid\":";
+        res += std::to_string(event.thread) + ",\"name\":";
+        if (event.phase == TracePhase::MARK) {
+            // Frames are counted per process, a burst of calls shows as a steep rise.
+            frames += event.value;
+            res += "\"frames\",\"ph\":\"C\",\"args\":{\"frames\":" + std::to_string(frames) + "}}";
+            continue;
+        }
+        AppendJsonString(&res, event.name);
+        res += event.phase == TracePhase::BEGIN ? ",\"ph\":\"B\"" : ",\"ph\":\"E\"";
+        if (event.kind == TraceKind::GC) {
+            res += event.phase == TracePhase::BEGIN ? ",\"args\":{\"heap_bytes\":"
+                                                    : ",\"args\":{\"freed_bytes\":";
+            res += std::to_string(event.value) + "}";
+        } else if (event.kind == TraceKind::PARSE && event.phase == TracePhase::BEGIN &&
+                   event.value) {
+            res += ",\"args\":{\"bytes\":" + std::to_string(event.value) + "}";
+        }
+        res += "}";
+    }
+    return res + "\n]}\n";
+}
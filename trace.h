@@ -0,0 +1,111 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+enum class TraceKind : uint8_t { CALL, GC, PARSE, SCOPE };
+enum class TracePhase : uint8_t { BEGIN, END, MARK };
+
+// Names are not copied, they must live as long as the process: literals or symbol names.
+struct TraceEvent {
+    uint64_t time;
+    const char* name;
+    uint64_t value;
+    uint32_t thread;
+    TraceKind kind;
+    TracePhase phase;
+};
+
+// Timeline of the process kept in a ring buffer, the oldest events are overwritten when it is
+// full. Probes on any thread record without locks, each slot carries a sequence number so that
+// a slot being overwritten while the events are copied is skipped.
+class Tracer {
+public:
+    static Tracer& Global() {
+        static Tracer tracer;
+        return tracer;
+    }
+
+    void Start();
+    void Stop();
+    void Clear() {
+        head_.store(0, std::memory_order_relaxed);
+    }
+
+    void Record(TraceKind kind, TracePhase phase, const char* name, uint64_t value);
+    // Events from the oldest kept one on.
+    std::vector<TraceEvent> Events() const;
+    // Chrome trace event JSON, which Perfetto and chrome://tracing open. Calls and parse phases
+    // are slices, collections are slices with the heap size and the freed bytes, frames made
+    // by calls form a counter.
+    std::string ExportChrome() const;
+
+private:
+    static constexpr size_t kCapacity = 1 << 16;
+
+    struct Slot {
+        std::atomic<uint64_t> sequence{0};
+        std::atomic<uint64_t> time{0};
+        std::atomic<const char*> name{nullptr};
+        std::atomic<uint64_t> value{0};
+        std::atomic<uint32_t> thread{0};
+        std::atomic<TraceKind> kind{TraceKind::CALL};
+        std::atomic<TracePhase> phase{TracePhase::MARK};
+    };
+
+    Tracer() : slots_(new Slot[kCapacity]), epoch_(std::chrono::steady_clock::now()) {
+    }
+
+    std::unique_ptr<Slot[]> slots_;
+    std::atomic<uint64_t> head_{0};
+    std::chrono::steady_clock::time_point epoch_;
+};
+
+// Set while the global tracer runs. With tracing off a probe costs one load and one branch.
+inline std::atomic<bool> tracing_enabled{false};
+
+inline void Trace(TraceKind kind, TracePhase phase, const char* name, uint64_t value = 0) {
+    if (tracing_enabled.load(std::memory_order_relaxed)) [[unlikely]] {
+        Tracer::Global().Record(kind, phase, name, value);
+    }
+}
+
+// Slice from construction to destruction. The name may be given as a function, which is called
+// only when tracing is on.
+class TraceSpan {
+public:
+    template <class Name>
+    TraceSpan(TraceKind kind, Name&& name, uint64_t value = 0)
+        : on_(tracing_enabled.load(std::memory_order_relaxed)), kind_(kind) {
+        if (on_) [[unlikely]] {
+            if constexpr (std::is_invocable_v<Name>) {
+                name_ = name();
+            } else {
+                name_ = name;
+            }
+            Tracer::Global().Record(kind_, TracePhase::BEGIN, name_, value);
+        }
+    }
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+    ~TraceSpan() {
+        if (on_) [[unlikely]] {
+            Tracer::Global().Record(kind_, TracePhase::END, name_, end_value_);
+        }
+    }
+
+    void SetEndValue(uint64_t value) {
+        end_value_ = value;
+    }
+
+private:
+    bool on_;
+    TraceKind kind_;
+    const char* name_ = nullptr;
+    uint64_t end_value_ = 0;
+};